@@ -0,0 +1,71 @@
+#!/bin/sh
+# Copyright 2016 Mozilla Foundation. See the COPYRIGHT
+# file at the top-level directory of this distribution.
+#
+# Licensed under the Apache License, Version 2.0 <LICENSE-APACHE or
+# http://www.apache.org/licenses/LICENSE-2.0> or the MIT license
+# <LICENSE-MIT or http://opensource.org/licenses/MIT>, at your
+# option. This file may not be copied, modified, or distributed
+# except according to those terms.
+
+# Compares the throughput of the --io backends: one large file converted
+# with mmap, stdio and uring, and a batch of many small files converted
+# with stdio and uring (batch mode doesn't map its inputs).
+#
+# Usage: bench/io_backends.sh [SIZE_MB] [FILES] [RECODE_CPP_ARGS...]
+#
+# A file of SIZE_MB megabytes (default 256) and FILES files (default 2000)
+# of 16 KB each of mixed ASCII and non-ASCII UTF-8 text are generated in
+# $TMPDIR. Outputs go to $TMPDIR as well, since io_uring is only used for
+# -o and batch outputs. Set DROP_CACHES=1 (as root) to read from the
+# device instead of the page cache. Extra arguments (e.g. -t
+# windows-1252) are passed to recode_cpp.
+
+set -e
+
+SIZE_MB=${1:-256}
+[ $# -gt 0 ] && shift
+FILES=${1:-2000}
+[ $# -gt 0 ] && shift
+RECODE_CPP=${RECODE_CPP:-./recode_cpp}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/recode_cpp_bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+printf 'The quick brown fox jumps over the lazy dog. \303\205ngstr\303\266m caf\303\251 \342\202\254\n' > "$WORK/line"
+yes "$(cat "$WORK/line")" | head -c "$((SIZE_MB * 1024 * 1024))" > "$WORK/large"
+mkdir "$WORK/small"
+head -c 16384 "$WORK/large" > "$WORK/small.template"
+i=0
+while [ $i -lt "$FILES" ]; do
+  cp "$WORK/small.template" "$WORK/small/$i.txt"
+  i=$((i + 1))
+done
+
+prepare() {
+  rm -rf "$WORK/out" "$WORK/out.txt"
+  if [ "${DROP_CACHES:-0}" = 1 ]; then
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+  else
+    cat "$WORK/large" "$WORK"/small/* > /dev/null
+  fi
+}
+
+seconds() {
+  start=$(date +%s.%N)
+  "$@"
+  end=$(date +%s.%N)
+  awk "BEGIN { print $end - $start }"
+}
+
+for io in mmap stdio uring; do
+  prepare
+  t=$(seconds "$RECODE_CPP" --io "$io" "$@" -o "$WORK/out.txt" "$WORK/large")
+  printf 'large %-5s %8.1f MB/s\n' "$io" "$(awk "BEGIN { print $SIZE_MB / $t }")"
+done
+
+for io in stdio uring; do
+  prepare
+  t=$(seconds "$RECODE_CPP" --io "$io" "$@" -B "$WORK/out" "$WORK"/small/* 2> /dev/null)
+  printf 'batch %-5s %8.0f files/s\n' "$io" "$(awk "BEGIN { print $FILES / $t }")"
+done
@@ -0,0 +1,236 @@
+// Copyright 2016 Mozilla Foundation. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// Licensed under the Apache License, Version 2.0 <LICENSE-APACHE or
+// http://www.apache.org/licenses/LICENSE-2.0> or the MIT license
+// <LICENSE-MIT or http://opensource.org/licenses/MIT>, at your
+// option. This file may not be copied, modified, or distributed
+// except according to those terms.
+
+// Measures the end-to-end latency of recode_cpp --line-buffered: runs
+// recode_cpp between two pipes, writes windows-1251 lines into one at a
+// steady pace, as a growing log would get them, and times how long each
+// line takes to come out of the other as UTF-8. Prints the percentiles of
+// the per-line latency.
+//
+// Usage: bench/line_latency [-n LINES] [-i INTERVAL_US] [-- RECODE_CPP_ARGS...]
+//
+// LINES defaults to 2000 and INTERVAL_US, the pause between lines, to 500
+// microseconds. recode_cpp is taken from $RECODE_CPP or ./recode_cpp and
+// run with -f windows-1251 --line-buffered followed by RECODE_CPP_ARGS
+// (e.g. -- --line-buffered=0 -u).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <getopt.h>
+#include <math.h>
+#include <memory>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+int64_t
+now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           Clock::now().time_since_epoch())
+    .count();
+}
+
+unsigned long
+get_number(const char* arg)
+{
+  char* end;
+  unsigned long number = strtoul(arg, &end, 10);
+  if (*end || !*arg || *arg == '-') {
+    fprintf(stderr, "%s is not a valid number; exiting.", arg);
+    exit(-2);
+  }
+  return number;
+}
+
+// Writes all of `length` bytes or exits.
+void
+write_all(int fd, const char* bytes, size_t length)
+{
+  while (length) {
+    ssize_t n = write(fd, bytes, length);
+    if (n < 0) {
+      fprintf(stderr, "Error writing to recode_cpp; exiting.");
+      exit(-5);
+    }
+    bytes += n;
+    length -= static_cast<size_t>(n);
+  }
+}
+
+// Starts `argv[0]` with its stdin and stdout connected to pipes, whose other
+// ends are returned in `to_child` and `from_child`.
+pid_t
+spawn(char** argv, int& to_child, int& from_child)
+{
+  int in[2];
+  int out[2];
+  if (pipe(in) || pipe(out)) {
+    fprintf(stderr, "Cannot create pipes; exiting.");
+    exit(-3);
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Cannot fork; exiting.");
+    exit(-3);
+  }
+  if (!pid) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    execv(argv[0], argv);
+    fprintf(stderr, "Cannot run %s; exiting.", argv[0]);
+    _exit(-3);
+  }
+  close(in[0]);
+  close(out[1]);
+  to_child = in[1];
+  from_child = out[0];
+  return pid;
+}
+
+// The `p`th percentile of `sorted` by the nearest-rank method.
+double
+percentile(const std::vector<int64_t>& sorted, double p)
+{
+  size_t rank = static_cast<size_t>(ceil(p / 100.0 * sorted.size()));
+  return sorted[rank ? rank - 1 : 0] / 1000.0;
+}
+
+int
+main(int argc, char** argv)
+{
+  static struct option long_options[] = {
+    { "lines", required_argument, NULL, 'n' },
+    { "interval", required_argument, NULL, 'i' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  size_t lines = 2000;
+  unsigned long interval_us = 500;
+
+  for (;;) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "n:i:h", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+      case 'n':
+        lines = get_number(optarg);
+        break;
+      case 'i':
+        interval_us = get_number(optarg);
+        break;
+      case 'h':
+        printf(
+          "Usage: %s [-n LINES] [-i INTERVAL_US] [-- RECODE_CPP_ARGS...]\n",
+          argv[0]);
+        exit(0);
+      default:
+        exit(-1);
+    }
+  }
+  if (!lines) {
+    fprintf(stderr, "There must be at least one line; exiting.");
+    exit(-2);
+  }
+
+  const char* recode_cpp = getenv("RECODE_CPP");
+  std::vector<char*> child_argv;
+  child_argv.push_back(const_cast<char*>(recode_cpp ? recode_cpp
+                                                    : "./recode_cpp"));
+  child_argv.push_back(const_cast<char*>("-f"));
+  child_argv.push_back(const_cast<char*>("windows-1251"));
+  child_argv.push_back(const_cast<char*>("--line-buffered"));
+  child_argv.insert(child_argv.end(), argv + optind, argv + argc);
+  child_argv.push_back(nullptr);
+
+  signal(SIGPIPE, SIG_IGN);
+  int to_child;
+  int from_child;
+  pid_t pid = spawn(child_argv.data(), to_child, from_child);
+
+  // When each line was written, published before the write so that the
+  // reader sees it once the converted line arrives.
+  std::unique_ptr<std::atomic<int64_t>[]> sent(
+    new std::atomic<int64_t>[lines]);
+  std::thread writer([&]() {
+    char line[64];
+    for (size_t i = 0; i < lines; i++) {
+      // "Привет, мир! " and the line number.
+      int length = snprintf(line,
+                            sizeof(line),
+                            "\xcf\xf0\xe8\xe2\xe5\xf2, \xec\xe8\xf0! %zu\n",
+                            i);
+      sent[i].store(now_ns(), std::memory_order_release);
+      write_all(to_child, line, static_cast<size_t>(length));
+      if (interval_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(interval_us));
+      }
+    }
+    close(to_child);
+  });
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(lines);
+  char buffer[64 * 1024];
+  for (;;) {
+    ssize_t n = read(from_child, buffer, sizeof(buffer));
+    if (n < 0) {
+      fprintf(stderr, "Error reading from recode_cpp; exiting.");
+      exit(-5);
+    }
+    if (!n) {
+      break;
+    }
+    int64_t received = now_ns();
+    for (ssize_t i = 0; i < n; i++) {
+      if (buffer[i] == '\n' && latencies.size() < lines) {
+        latencies.push_back(
+          received - sent[latencies.size()].load(std::memory_order_acquire));
+      }
+    }
+  }
+  writer.join();
+  close(from_child);
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "recode_cpp failed; exiting.");
+    exit(-4);
+  }
+  if (latencies.size() != lines) {
+    fprintf(stderr,
+            "Got %zu lines back instead of %zu; exiting.",
+            latencies.size(),
+            lines);
+    exit(-4);
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  printf("lines %zu, interval %lu us\n", lines, interval_us);
+  printf("latency p50 %10.1f us\n", percentile(latencies, 50));
+  printf("latency p90 %10.1f us\n", percentile(latencies, 90));
+  printf("latency p99 %10.1f us\n", percentile(latencies, 99));
+  printf("latency max %10.1f us\n", percentile(latencies, 100));
+  return 0;
+}
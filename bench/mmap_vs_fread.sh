@@ -0,0 +1,43 @@
+#!/bin/sh
+# Copyright 2016 Mozilla Foundation. See the COPYRIGHT
+# file at the top-level directory of this distribution.
+#
+# Licensed under the Apache License, Version 2.0 <LICENSE-APACHE or
+# http://www.apache.org/licenses/LICENSE-2.0> or the MIT license
+# <LICENSE-MIT or http://opensource.org/licenses/MIT>, at your
+# option. This file may not be copied, modified, or distributed
+# except according to those terms.
+
+# Compares the throughput of the memory-mapped input path with the fread
+# path.
+#
+# Usage: bench/mmap_vs_fread.sh [SIZE_MB] [RECODE_CPP_ARGS...]
+#
+# A file of SIZE_MB megabytes (default 256) of mixed ASCII and non-ASCII
+# UTF-8 text is generated in $TMPDIR and converted with both input paths.
+# Extra arguments (e.g. -t windows-1252) are passed to recode_cpp.
+
+set -e
+
+SIZE_MB=${1:-256}
+[ $# -gt 0 ] && shift
+RECODE_CPP=${RECODE_CPP:-./recode_cpp}
+INPUT=$(mktemp "${TMPDIR:-/tmp}/recode_cpp_bench.XXXXXX")
+trap 'rm -f "$INPUT"' EXIT
+
+printf 'The quick brown fox jumps over the lazy dog. \303\205ngstr\303\266m caf\303\251 \342\202\254\n' > "$INPUT.line"
+yes "$(cat "$INPUT.line")" | head -c "$((SIZE_MB * 1024 * 1024))" > "$INPUT"
+rm -f "$INPUT.line"
+
+run() {
+  start=$(date +%s.%N)
+  "$RECODE_CPP" "$@" "$INPUT" > /dev/null
+  end=$(date +%s.%N)
+  awk "BEGIN { print $SIZE_MB / ($end - $start) }"
+}
+
+# Warm the page cache so that both runs read from memory.
+cat "$INPUT" > /dev/null
+
+printf 'mmap:  %.1f MB/s\n' "$(run "$@")"
+printf 'fread: %.1f MB/s\n' "$(run --no-mmap "$@")"
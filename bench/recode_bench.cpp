@@ -0,0 +1,595 @@
+// Copyright 2016 Mozilla Foundation. See the COPYRIGHT
+// file at the top-level directory of this distribution.
+//
+// Licensed under the Apache License, Version 2.0 <LICENSE-APACHE or
+// http://www.apache.org/licenses/LICENSE-2.0> or the MIT license
+// <LICENSE-MIT or http://opensource.org/licenses/MIT>, at your
+// option. This file may not be copied, modified, or distributed
+// except according to those terms.
+
+// Measures transcoding throughput for every pair of encodings over a set of
+// corpora through the streaming API (with UTF-8 and UTF-16 intermediates,
+// as recode_cpp does) and the one-shot API, and prints the results as JSON
+// for regression tracking. With --short, the corpora are instead strings of
+// a few dozen bytes, for which the per-call overhead of the one-shot API
+// matters more than the per-byte cost.
+//
+// Cycles are read from the time stamp counter, which ticks at a constant
+// reference rate rather than the current core clock, and are only available
+// on x86. Allocations are the C++ heap allocations per conversion; the
+// allocations that encoding_rs makes on the Rust side are not included.
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../encoding_rs_cpp.h"
+
+using namespace encoding_rs;
+
+static size_t allocations = 0;
+
+void*
+operator new(size_t size)
+{
+  allocations++;
+  void* ptr = malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void
+operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void
+operator delete(void* ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+static uint64_t
+cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+#define STREAMING_STEP_SIZE (64 * 1024)
+
+// Short inputs are converted repeatedly between reads of the clock so that
+// reading the clock doesn't dominate the measurement.
+#define MIN_BATCH_BYTES (64 * 1024)
+
+// All the encodings in encoding_rs_statics.h.
+static std::vector<const Encoding*>
+all_encodings()
+{
+  return {
+    BIG5_ENCODING,
+    EUC_JP_ENCODING,
+    EUC_KR_ENCODING,
+    GBK_ENCODING,
+    IBM866_ENCODING,
+    ISO_2022_JP_ENCODING,
+    ISO_8859_10_ENCODING,
+    ISO_8859_13_ENCODING,
+    ISO_8859_14_ENCODING,
+    ISO_8859_15_ENCODING,
+    ISO_8859_16_ENCODING,
+    ISO_8859_2_ENCODING,
+    ISO_8859_3_ENCODING,
+    ISO_8859_4_ENCODING,
+    ISO_8859_5_ENCODING,
+    ISO_8859_6_ENCODING,
+    ISO_8859_7_ENCODING,
+    ISO_8859_8_ENCODING,
+    ISO_8859_8_I_ENCODING,
+    KOI8_R_ENCODING,
+    KOI8_U_ENCODING,
+    SHIFT_JIS_ENCODING,
+    UTF_16BE_ENCODING,
+    UTF_16LE_ENCODING,
+    UTF_8_ENCODING,
+    GB18030_ENCODING,
+    MACINTOSH_ENCODING,
+    REPLACEMENT_ENCODING,
+    WINDOWS_1250_ENCODING,
+    WINDOWS_1251_ENCODING,
+    WINDOWS_1252_ENCODING,
+    WINDOWS_1253_ENCODING,
+    WINDOWS_1254_ENCODING,
+    WINDOWS_1255_ENCODING,
+    WINDOWS_1256_ENCODING,
+    WINDOWS_1257_ENCODING,
+    WINDOWS_1258_ENCODING,
+    WINDOWS_874_ENCODING,
+    X_MAC_CYRILLIC_ENCODING,
+    X_USER_DEFINED_ENCODING,
+  };
+}
+
+struct Corpus
+{
+  std::string name;
+  // UTF-8 text that is encoded into each source encoding, or, if `raw`,
+  // bytes that are used as the input for every source encoding as is.
+  std::string text;
+  bool raw;
+};
+
+// Repeats `sample` to `size` bytes without splitting a character.
+static std::string
+repeat(const char* sample, size_t size)
+{
+  std::string text;
+  size_t length = strlen(sample);
+  while (text.size() + length <= size) {
+    text.append(sample, length);
+  }
+  return text;
+}
+
+static std::vector<Corpus>
+synthetic_corpora(size_t size)
+{
+  std::vector<Corpus> corpora;
+  corpora.push_back(
+    { "ascii",
+      repeat("The quick brown fox jumps over the lazy dog, and then "
+             "<a href=\"https://example.com/\">follows the link</a>.\n",
+             size),
+      false });
+  corpora.push_back(
+    { "cjk",
+      repeat("\xE6\x96\x87\xE5\xAD\x97\xE5\x8C\x96\xE3\x81\x91\xE3\x81\xAF"
+             "\xE3\x80\x81\xE3\x82\xB3\xE3\x83\xB3\xE3\x83\x94\xE3\x83\xA5"
+             "\xE3\x83\xBC\xE3\x82\xBF\xE3\x81\xA7\xE6\x96\x87\xE5\xAD\x97"
+             "\xE3\x82\x92\xE6\xAD\xA3\xE3\x81\x97\xE3\x81\x8F\xE8\xA1\xA8"
+             "\xE7\xA4\xBA\xE3\x81\xA7\xE3\x81\x8D\xE3\x81\xAA\xE3\x81\x84"
+             "\xE7\x8F\xBE\xE8\xB1\xA1\xE3\x81\xA7\xE3\x81\x99\xE3\x80\x82"
+             "\xE4\xB8\xAD\xE6\x96\x87\xE7\xBC\x96\xE7\xA0\x81 GB 18030\n",
+             size),
+      false });
+  corpora.push_back(
+    { "cyrillic",
+      repeat("\xD0\xA1\xD1\x8A\xD0\xB5\xD1\x88\xD1\x8C \xD0\xB6\xD0\xB5 "
+             "\xD0\xB5\xD1\x89\xD1\x91 \xD1\x8D\xD1\x82\xD0\xB8\xD1\x85 "
+             "\xD0\xBC\xD1\x8F\xD0\xB3\xD0\xBA\xD0\xB8\xD1\x85 "
+             "\xD1\x84\xD1\x80\xD0\xB0\xD0\xBD\xD1\x86\xD1\x83\xD0\xB7"
+             "\xD1\x81\xD0\xBA\xD0\xB8\xD1\x85 \xD0\xB1\xD1\x83\xD0\xBB"
+             "\xD0\xBE\xD0\xBA, \xD0\xB4\xD0\xB0 \xD0\xB2\xD1\x8B\xD0\xBF"
+             "\xD0\xB5\xD0\xB9 \xD0\xB6\xD0\xB5 \xD1\x87\xD0\xB0\xD1\x8E.\n",
+             size),
+      false });
+  corpora.push_back(
+    { "mixed",
+      repeat("Caf\xC3\xA9 \xC3\x85ngstr\xC3\xB6m \xE2\x82\xAC 5 "
+             "\xCE\x95\xCE\xBB\xCE\xBB\xCE\xB7\xCE\xBD\xCE\xB9\xCE\xBA\xCE\xAC "
+             "\xD7\xA2\xD7\x91\xD7\xA8\xD7\x99\xD7\xAA "
+             "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E "
+             "\xED\x95\x9C\xEA\xB5\xAD\xEC\x96\xB4 "
+             "\xF0\x9F\x98\x80 plain ASCII in between.\n",
+             size),
+      false });
+  std::string noise(size, '\0');
+  uint32_t state = 0x12345678;
+  for (char& c : noise) {
+    state = state * 1103515245 + 12345;
+    c = static_cast<char>(state >> 24);
+  }
+  corpora.push_back({ "malformed", noise, true });
+  return corpora;
+}
+
+// Strings like identifiers, form fields and database columns: pure ASCII,
+// ASCII with a non-ASCII tail and no ASCII at all.
+static std::vector<Corpus>
+short_corpora()
+{
+  return {
+    { "short-ascii", "first.last@example.com", false },
+    { "short-ascii-tail", "Delivery to Malm\xC3\xB6", false },
+    { "short-non-ascii",
+      "\xD0\x9C\xD0\xBE\xD1\x81\xD0\xBA\xD0\xB2\xD0\xB0",
+      false },
+  };
+}
+
+// Returns the corpus as it would look in `encoding`.
+static std::vector<uint8_t>
+source_bytes(const Corpus& corpus, const Encoding* encoding)
+{
+  if (corpus.raw) {
+    return std::vector<uint8_t>(corpus.text.begin(), corpus.text.end());
+  }
+  if (encoding == UTF_16LE_ENCODING || encoding == UTF_16BE_ENCODING) {
+    // The encoder for UTF-16 produces UTF-8, so serialize by hand.
+    auto [units, had_errors] = UTF_8_ENCODING->decode16_without_bom_handling(
+      gsl::make_span(reinterpret_cast<const uint8_t*>(corpus.text.data()),
+                     corpus.text.size()));
+    (void)had_errors;
+    bool big_endian = (encoding == UTF_16BE_ENCODING);
+    std::vector<uint8_t> bytes;
+    bytes.reserve(units.size() * 2);
+    for (char16_t unit : units) {
+      bytes.push_back(static_cast<uint8_t>(big_endian ? unit >> 8 : unit));
+      bytes.push_back(static_cast<uint8_t>(big_endian ? unit : unit >> 8));
+    }
+    return bytes;
+  }
+  return std::get<0>(encoding->encode(corpus.text));
+}
+
+// The conversions being measured. Each returns the number of bytes of
+// output so that the work can't be optimized away.
+
+static size_t
+streaming_via_utf8(const Encoding* from,
+                   const Encoding* to,
+                   gsl::span<const uint8_t> input)
+{
+  auto decoder = from->new_decoder();
+  auto encoder = to->new_encoder();
+  std::vector<uint8_t> intermediate(
+    *decoder->max_utf8_buffer_length(STREAMING_STEP_SIZE));
+  std::vector<uint8_t> output(
+    *encoder->max_buffer_length_from_utf8_if_no_unmappables(
+      intermediate.size()));
+  size_t total = 0;
+  bool last = false;
+  while (!last) {
+    gsl::span<const uint8_t> step =
+      input.first(std::min<size_t>(STREAMING_STEP_SIZE, input.size()));
+    input = input.subspan(step.size());
+    last = input.empty();
+    for (;;) {
+      auto [decoder_result, decoder_read, decoder_written, decoder_errors] =
+        decoder->decode_to_utf8(step, intermediate, last);
+      (void)decoder_errors;
+      step = step.subspan(decoder_read);
+      std::string_view utf8(reinterpret_cast<char*>(intermediate.data()),
+                            decoder_written);
+      bool last_output = last && decoder_result == INPUT_EMPTY;
+      for (;;) {
+        auto [encoder_result, encoder_read, encoder_written, encoder_errors] =
+          encoder->encode_from_utf8(utf8, output, last_output);
+        (void)encoder_errors;
+        utf8 = utf8.substr(encoder_read);
+        total += encoder_written;
+        if (encoder_result == INPUT_EMPTY) {
+          break;
+        }
+      }
+      if (decoder_result == INPUT_EMPTY) {
+        break;
+      }
+    }
+  }
+  return total;
+}
+
+static size_t
+streaming_via_utf16(const Encoding* from,
+                    const Encoding* to,
+                    gsl::span<const uint8_t> input)
+{
+  auto decoder = from->new_decoder();
+  auto encoder = to->new_encoder();
+  std::vector<char16_t> intermediate(
+    *decoder->max_utf16_buffer_length(STREAMING_STEP_SIZE));
+  std::vector<uint8_t> output(
+    *encoder->max_buffer_length_from_utf16_if_no_unmappables(
+      intermediate.size()));
+  size_t total = 0;
+  bool last = false;
+  while (!last) {
+    gsl::span<const uint8_t> step =
+      input.first(std::min<size_t>(STREAMING_STEP_SIZE, input.size()));
+    input = input.subspan(step.size());
+    last = input.empty();
+    for (;;) {
+      auto [decoder_result, decoder_read, decoder_written, decoder_errors] =
+        decoder->decode_to_utf16(step, intermediate, last);
+      (void)decoder_errors;
+      step = step.subspan(decoder_read);
+      std::u16string_view utf16(intermediate.data(), decoder_written);
+      bool last_output = last && decoder_result == INPUT_EMPTY;
+      for (;;) {
+        auto [encoder_result, encoder_read, encoder_written, encoder_errors] =
+          encoder->encode_from_utf16(utf16, output, last_output);
+        (void)encoder_errors;
+        utf16 = utf16.substr(encoder_read);
+        total += encoder_written;
+        if (encoder_result == INPUT_EMPTY) {
+          break;
+        }
+      }
+      if (decoder_result == INPUT_EMPTY) {
+        break;
+      }
+    }
+  }
+  return total;
+}
+
+static size_t
+one_shot_via_utf8(const Encoding* from,
+                  const Encoding* to,
+                  gsl::span<const uint8_t> input)
+{
+  auto decoded = std::get<0>(from->decode(input));
+  return std::get<0>(to->encode(std::string_view(decoded))).size();
+}
+
+static size_t
+one_shot_via_utf16(const Encoding* from,
+                   const Encoding* to,
+                   gsl::span<const uint8_t> input)
+{
+  auto decoded = std::get<0>(from->decode16(input));
+  return std::get<0>(to->encode(std::u16string_view(decoded))).size();
+}
+
+struct Api
+{
+  const char* name;
+  size_t (*convert)(const Encoding*,
+                    const Encoding*,
+                    gsl::span<const uint8_t>);
+};
+
+static const Api APIS[] = {
+  { "streaming-utf8", streaming_via_utf8 },
+  { "streaming-utf16", streaming_via_utf16 },
+  { "one-shot-utf8", one_shot_via_utf8 },
+  { "one-shot-utf16", one_shot_via_utf16 },
+};
+
+static const Encoding*
+get_encoding(const char* label)
+{
+  const Encoding* enc =
+    Encoding::for_label(gsl::cstring_span<>(label, strlen(label)));
+  if (!enc) {
+    fprintf(stderr, "%s is not a known encoding label; exiting.", label);
+    exit(-2);
+  }
+  return enc;
+}
+
+// Parses a decimal number from `min` to `max` or exits.
+static unsigned long
+get_number(const char* arg, unsigned long min, unsigned long max)
+{
+  char* end;
+  errno = 0;
+  unsigned long number = strtoul(arg, &end, 10);
+  if (*end || end == arg || *arg == '-' || errno || number < min ||
+      number > max) {
+    fprintf(stderr, "%s is not a valid number; exiting.", arg);
+    exit(-2);
+  }
+  return number;
+}
+
+// Returns `text` as a JSON string literal.
+static std::string
+json_string(const std::string& text)
+{
+  std::string json("\"");
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      json.push_back('\\');
+      json.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[7];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      json.append(escaped);
+    } else {
+      json.push_back(c);
+    }
+  }
+  json.push_back('"');
+  return json;
+}
+
+static std::string
+read_file(const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Cannot open %s for reading; exiting.", path);
+    exit(-4);
+  }
+  std::string text;
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file))) {
+    text.append(buffer, n);
+  }
+  if (ferror(file)) {
+    fprintf(stderr, "Error reading input.");
+    exit(-5);
+  }
+  fclose(file);
+  return text;
+}
+
+static void
+print_usage(const char* program)
+{
+  printf(
+    "Usage: %s [-f LABEL] [-t LABEL] [-c NAME=PATH] [-s BYTES] [-m MS] "
+    "[-w]\n\n"
+    "Options:\n"
+    "    -f, --from-code LABEL\n"
+    "                        only measure this source encoding\n"
+    "    -t, --to-code LABEL\n"
+    "                        only measure this target encoding\n"
+    "    -c, --corpus NAME=PATH\n"
+    "                        also measure the UTF-8 text at PATH\n"
+    "    -s, --size BYTES    size of the synthetic corpora (defaults to\n"
+    "                        1048576)\n"
+    "    -m, --min-time MS   repeat each measurement for at least MS\n"
+    "                        milliseconds (defaults to 20)\n"
+    "    -w, --short         measure short strings instead of the synthetic\n"
+    "                        corpora\n"
+    "    -h, --help          print usage help\n",
+    program);
+}
+
+int
+main(int argc, char** argv)
+{
+  static struct option long_options[] = {
+    { "from-code", required_argument, NULL, 'f' },
+    { "to-code", required_argument, NULL, 't' },
+    { "corpus", required_argument, NULL, 'c' },
+    { "size", required_argument, NULL, 's' },
+    { "min-time", required_argument, NULL, 'm' },
+    { "short", no_argument, NULL, 'w' },
+    { "help", no_argument, NULL, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  const Encoding* only_from = nullptr;
+  const Encoding* only_to = nullptr;
+  size_t size = 1024 * 1024;
+  long min_time_ms = 20;
+  bool short_strings = false;
+  std::vector<Corpus> real_corpora;
+
+  for (;;) {
+    int option_index = 0;
+    int c =
+      getopt_long(argc, argv, "f:t:c:s:m:wh", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+    switch (c) {
+      case 'f':
+        only_from = get_encoding(optarg);
+        break;
+      case 't':
+        only_to = get_encoding(optarg);
+        break;
+      case 'c': {
+        const char* equals = strchr(optarg, '=');
+        if (!equals) {
+          print_usage(argv[0]);
+          exit(-1);
+        }
+        std::string name(optarg, equals - optarg);
+        real_corpora.push_back({ name, read_file(equals + 1), false });
+        break;
+      }
+      case 's':
+        size = get_number(optarg, 1, SIZE_MAX);
+        break;
+      case 'm':
+        min_time_ms = static_cast<long>(get_number(optarg, 0, LONG_MAX));
+        break;
+      case 'w':
+        short_strings = true;
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        exit(0);
+      default:
+        print_usage(argv[0]);
+        exit(-1);
+    }
+  }
+
+  std::vector<Corpus> corpora =
+    short_strings ? short_corpora() : synthetic_corpora(size);
+  corpora.insert(corpora.end(), real_corpora.begin(), real_corpora.end());
+  std::vector<const Encoding*> encodings = all_encodings();
+  auto min_time = std::chrono::milliseconds(min_time_ms);
+
+  printf("{\n  \"synthetic_corpus_bytes\": %zu,\n  \"short\": %s,\n"
+         "  \"min_time_ms\": %ld,\n  \"results\": [",
+         size,
+         short_strings ? "true" : "false",
+         min_time_ms);
+  const char* separator = "\n";
+  for (const Corpus& corpus : corpora) {
+    for (const Encoding* from : encodings) {
+      if (only_from && from != only_from) {
+        continue;
+      }
+      std::vector<uint8_t> input = source_bytes(corpus, from);
+      for (const Encoding* to : encodings) {
+        if (only_to && to != only_to) {
+          continue;
+        }
+        size_t batch = std::max<size_t>(
+          1, MIN_BATCH_BYTES / std::max<size_t>(1, input.size()));
+        for (const Api& api : APIS) {
+          size_t iterations = 0;
+          size_t output_size = 0;
+          size_t allocations_before = allocations;
+          uint64_t cycles_before = cycles();
+          auto start = std::chrono::steady_clock::now();
+          auto elapsed = std::chrono::steady_clock::duration(0);
+          do {
+            for (size_t i = 0; i < batch; i++) {
+              output_size = api.convert(from, to, input);
+            }
+            iterations += batch;
+            elapsed = std::chrono::steady_clock::now() - start;
+          } while (elapsed < min_time);
+          uint64_t cycles_taken = cycles() - cycles_before;
+          double seconds = std::chrono::duration<double>(elapsed).count();
+          double bytes = static_cast<double>(input.size()) * iterations;
+          printf("%s    { \"corpus\": %s, \"from\": \"%s\", "
+                 "\"to\": \"%s\", \"api\": \"%s\", \"input_bytes\": %zu, "
+                 "\"output_bytes\": %zu, \"iterations\": %zu, "
+                 "\"mb_per_s\": %.2f, \"ns_per_call\": %.1f, ",
+                 separator,
+                 json_string(corpus.name).c_str(),
+                 from->name().c_str(),
+                 to->name().c_str(),
+                 api.name,
+                 input.size(),
+                 output_size,
+                 iterations,
+                 bytes / seconds / 1e6,
+                 seconds * 1e9 / iterations);
+          if (cycles_taken && bytes > 0) {
+            printf("\"cycles_per_byte\": %.3f, ", cycles_taken / bytes);
+          } else {
+            printf("\"cycles_per_byte\": null, ");
+          }
+          printf("\"allocations\": %.1f }",
+                 static_cast<double>(allocations - allocations_before) /
+                   iterations);
+          separator = ",\n";
+          fflush(stdout);
+        }
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+  exit(0);
+}
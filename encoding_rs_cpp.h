@@ -13,11 +13,23 @@
 #define encoding_rs_cpp_h_
 
 #include "gsl/gsl"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <map>
 #include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <variant>
 #include <vector>
 
 namespace encoding_rs {
@@ -648,6 +660,202 @@ private:
   Encoder& operator=(const Encoder&) = delete;
 };
 
+/**
+ * A pool of idle `Decoder`s or `Encoder`s per thread.
+ *
+ * Each instantiation of a decoder or an encoder allocates on the Rust side
+ * and each destruction frees the memory again. When many short inputs are
+ * converted, this shows up in profiles. `Encoding::pooled_decoder()`,
+ * `Encoding::pooled_encoder()` and the one-shot methods of `Encoding` avoid
+ * the allocation by reinitializing an idle instance from the calling
+ * thread's pool with `new_decoder_into()` or `new_encoder_into()`. The
+ * smart pointers that they return give the instance back to the pool of
+ * the thread that destroys them.
+ *
+ * Since the instances are reinitialized on the way out of the pool, an
+ * instance that was used for one encoding serves any other encoding just
+ * as well. Each thread keeps at most `CAPACITY` idle instances of each
+ * type and frees them when the thread exits. Pooled instances must
+ * therefore not outlive the thread-local storage of the thread that
+ * destroys them.
+ */
+template<class T>
+class CoderPool final
+{
+public:
+  /**
+   * The maximum number of idle instances per thread.
+   */
+  static constexpr size_t CAPACITY = 4;
+
+  /**
+   * Takes an idle instance out of the calling thread's pool or returns
+   * `nullptr` if the pool is empty.
+   *
+   * The instance is in whatever state its previous user left it in and
+   * must be reinitialized with `new_decoder_into()` or `new_encoder_into()`
+   * before use.
+   */
+  static inline T* take()
+  {
+    auto& pool = idle();
+    if (pool.empty()) {
+      return nullptr;
+    }
+    T* coder = pool.back().release();
+    pool.pop_back();
+    return coder;
+  }
+
+  /**
+   * Puts `coder` into the calling thread's pool or frees it if the pool is
+   * already full.
+   */
+  static inline void give_back(T* coder)
+  {
+    auto& pool = idle();
+    if (pool.size() < CAPACITY) {
+      pool.emplace_back(coder);
+    } else {
+      delete coder;
+    }
+  }
+
+  /**
+   * Frees the idle instances of the calling thread.
+   */
+  static inline void clear() { idle().clear(); }
+
+private:
+  static inline std::vector<std::unique_ptr<T>>& idle()
+  {
+    // Reserved up front so that giving back never allocates.
+    thread_local std::vector<std::unique_ptr<T>> pool = [] {
+      std::vector<std::unique_ptr<T>> pool;
+      pool.reserve(CAPACITY);
+      return pool;
+    }();
+    return pool;
+  }
+
+  CoderPool() = delete;
+};
+
+/**
+ * The deleter of `PooledDecoder` and `PooledEncoder`, which gives the
+ * instance back to the calling thread's `CoderPool` instead of freeing it.
+ */
+template<class T>
+struct CoderPoolDeleter
+{
+  inline void operator()(T* coder) const { CoderPool<T>::give_back(coder); }
+};
+
+/**
+ * A `Decoder` borrowed from a `CoderPool`.
+ */
+typedef std::unique_ptr<Decoder, CoderPoolDeleter<Decoder>> PooledDecoder;
+
+/**
+ * An `Encoder` borrowed from a `CoderPool`.
+ */
+typedef std::unique_ptr<Encoder, CoderPoolDeleter<Encoder>> PooledEncoder;
+
+/**
+ * The UTF-8 result of a borrowing decode such as
+ * `Encoding::decode_borrowing()`: either a view into the input, when the
+ * input (after a BOM that was removed) decodes to itself, or a newly
+ * allocated string. This corresponds to the `Cow<str>` that the Rust API
+ * returns.
+ *
+ * A borrowed string is only valid as long as the input buffer is.
+ */
+class CowString final
+{
+public:
+  explicit CowString(std::string_view borrowed)
+    : value_(borrowed)
+  {
+  }
+
+  explicit CowString(std::string owned)
+    : value_(std::move(owned))
+  {
+  }
+
+  /**
+   * Whether the string is a view into the input.
+   */
+  inline bool is_borrowed() const
+  {
+    return std::holds_alternative<std::string_view>(value_);
+  }
+
+  /**
+   * A view of the string whether it is borrowed or owned.
+   */
+  inline std::string_view view() const
+  {
+    if (is_borrowed()) {
+      return std::get<std::string_view>(value_);
+    }
+    return std::get<std::string>(value_);
+  }
+
+  inline operator std::string_view() const { return view(); }
+
+  /**
+   * Returns an owning string, copying the string only if it is borrowed.
+   */
+  inline std::string into_owned() &&
+  {
+    if (is_borrowed()) {
+      return std::string(std::get<std::string_view>(value_));
+    }
+    return std::move(std::get<std::string>(value_));
+  }
+
+private:
+  std::variant<std::string_view, std::string> value_;
+};
+
+/**
+ * A column of strings in the layout of the string arrays of Apache Arrow
+ * (and of the byte arrays of Parquet once read): the values one after
+ * another in `values`, value `i` being the bytes from `offsets[i]` up to
+ * `offsets[i + 1]`, and a bitmap with a bit per value.
+ *
+ * `Offset` is the type of the offsets, e.g. `int32_t` for Arrow's `Utf8`
+ * or `int64_t` for `LargeUtf8`.
+ */
+template<class Offset>
+struct StringColumn
+{
+  std::vector<uint8_t> values;
+
+  /**
+   * One more entry than there are values, starting with zero.
+   */
+  std::vector<Offset> offsets;
+
+  /**
+   * Bit `i % 8` of byte `i / 8` (least significant bit first, as in Arrow
+   * validity bitmaps) is set if value `i` had malformed sequences when
+   * decoding or unmappable characters when encoding.
+   */
+  std::vector<uint8_t> had_errors;
+
+  inline size_t size() const
+  {
+    return offsets.empty() ? 0 : offsets.size() - 1;
+  }
+
+  inline bool value_had_errors(size_t i) const
+  {
+    return had_errors[i / 8] & (1 << (i % 8));
+  }
+};
+
 /**
  * An encoding as defined in the Encoding Standard
  * (https://encoding.spec.whatwg.org/).
@@ -674,9 +882,21 @@ private:
  * `decode_without_bom_handling()`,
  * `decode_without_bom_handling_and_without_replacement()` and
  * `encode()`. Unlike the rest of the API, these methods perform heap
- * allocations. You should the `Decoder` and `Encoder` objects when your input
- * is split into multiple buffers or when you want to control the allocation of
- * the output buffers.
+ * allocations for their output. (The decoder or encoder that they use
+ * internally comes from the calling thread's `CoderPool` and isn't
+ * allocated anew each time.) The overloads of
+ * `decode_without_bom_handling()`, `decode16_without_bom_handling()` and
+ * `encode()` that take a container append to it instead, the ones that
+ * take a `std::pmr::memory_resource*` allocate from that resource and
+ * `decode_without_bom_handling_into()`, `decode16_without_bom_handling_into()`
+ * and `encode_into()` write to a caller-allocated buffer. The decoding
+ * methods ending in `_borrowing` return a `CowString` that refers to the
+ * input instead of a copy when the input decodes to itself, and
+ * `decode_column()` and `encode_column()` convert many short strings
+ * stored one after another.
+ * You should use the `Decoder` and `Encoder` objects when your input is
+ * split into multiple buffers, and a `Transcoder` to drive a decoder and
+ * an encoder together when converting from one encoding to another.
  *
  * # Instances
  *
@@ -859,7 +1079,9 @@ public:
       encoding = this;
     }
     auto [str, had_errors] = encoding->decode_without_bom_handling(bytes);
-    return { str, gsl::not_null<const Encoding*>(encoding), had_errors };
+    return { std::move(str),
+             gsl::not_null<const Encoding*>(encoding),
+             had_errors };
   }
 
   /**
@@ -882,19 +1104,7 @@ public:
   inline std::tuple<std::string, bool> decode_with_bom_removal(
     gsl::span<const uint8_t> bytes) const
   {
-    if (this == UTF_8_ENCODING && bytes.size() >= 3 &&
-        (gsl::as_bytes(bytes.first<3>()) ==
-         gsl::as_bytes(gsl::make_span("\xEF\xBB\xBF")))) {
-      bytes = bytes.subspan(3, bytes.size() - 3);
-    } else if (this == UTF_16LE_ENCODING && bytes.size() >= 2 &&
-               (gsl::as_bytes(bytes.first<2>()) ==
-                gsl::as_bytes(gsl::make_span("\xFF\xFE")))) {
-      bytes = bytes.subspan(2, bytes.size() - 2);
-    } else if (this == UTF_16BE_ENCODING && bytes.size() >= 2 &&
-               (gsl::as_bytes(bytes.first<2>()) ==
-                gsl::as_bytes(gsl::make_span("\xFE\xFF")))) {
-      bytes = bytes.subspan(2, bytes.size() - 2);
-    }
+    bytes = bytes.subspan(own_bom_length(bytes));
     return decode_without_bom_handling(bytes);
   }
 
@@ -918,21 +1128,128 @@ public:
   inline std::tuple<std::string, bool> decode_without_bom_handling(
     gsl::span<const uint8_t> bytes) const
   {
-    auto decoder = new_decoder_without_bom_handling();
+    std::string string;
+    bool had_errors = decode_without_bom_handling(bytes, string);
+    return { std::move(string), had_errors };
+  }
+
+  /**
+   * Like `decode_without_bom_handling()` but appends the output to `string`
+   * (e.g. a `std::string` or a `std::pmr::string`) instead of returning a
+   * new string and returns only whether there were malformed sequences.
+   *
+   * The prefix that decodes to itself (see `decodes_as_is_up_to()`) is
+   * copied without a decoder; an input that consists only of such a prefix
+   * doesn't involve a decoder at all. For the rest, space for the worst
+   * case is allocated up front, except that for a rest of at least
+   * `TWO_PASS_THRESHOLD` bytes whose worst case is more than a quarter
+   * longer than the rest itself, the rest is first decoded into scratch
+   * space on the stack in order to measure the output, so that the string
+   * grows only by about as much as the output needs.
+   */
+  template<class Allocator>
+  inline bool decode_without_bom_handling(
+    gsl::span<const uint8_t> bytes,
+    std::basic_string<char, std::char_traits<char>, Allocator>& string) const
+  {
+    size_t as_is = decodes_as_is_up_to(bytes);
+    if (as_is == static_cast<size_t>(bytes.size())) {
+      string.append(reinterpret_cast<const char*>(bytes.data()), as_is);
+      return false;
+    }
+    gsl::span<const uint8_t> prefix = bytes.first(as_is);
+    bytes = bytes.subspan(as_is);
+    auto decoder = pooled_decoder_without_bom_handling();
     auto needed = decoder->max_utf8_buffer_length(bytes.size());
     if (!needed) {
       throw std::overflow_error("Overflow in buffer size computation.");
     }
-    std::string string(needed.value(), '\0');
-    const auto [result, read, written, had_errors] = decoder->decode_to_utf8(
-      bytes,
-      gsl::make_span(reinterpret_cast<uint8_t*>(&string[0]), string.size()),
-      true);
-    assert(read == static_cast<size_t>(bytes.size()));
-    assert(written <= static_cast<size_t>(string.size()));
-    assert(result == INPUT_EMPTY);
-    string.resize(written);
-    return { string, had_errors };
+    if (worth_measuring(bytes.size(), needed.value())) {
+      size_t total_read = 0;
+      needed = measure([&](gsl::span<uint8_t> scratch) {
+        const auto [result, read, written, had_errors] =
+          decoder->decode_to_utf8(bytes.subspan(total_read), scratch, true);
+        total_read += read;
+        return std::make_tuple(result, written);
+      }) + MEASURE_SLACK;
+      new_decoder_without_bom_handling_into(*decoder);
+    }
+    // Should the decoder still want more room than the measured length and
+    // the slack for the last characters, the space is extended as long as
+    // it reports that the output is full.
+    size_t start = string.size();
+    string.resize(start + prefix.size() + needed.value());
+    copy_prefix(prefix, string.data() + start);
+    start += prefix.size();
+    bool total_had_errors = false;
+    size_t total_read = 0;
+    size_t total_written = 0;
+    for (;;) {
+      string.resize(start + total_written + needed.value());
+      const auto [result, read, written, had_errors] = decoder->decode_to_utf8(
+        bytes.subspan(total_read),
+        gsl::make_span(reinterpret_cast<uint8_t*>(string.data()) + start +
+                         total_written,
+                       needed.value()),
+        true);
+      total_read += read;
+      total_written += written;
+      total_had_errors |= had_errors;
+      if (result == INPUT_EMPTY) {
+        assert(total_read == static_cast<size_t>(bytes.size()));
+        string.resize(start + total_written);
+        return total_had_errors;
+      }
+      needed = decoder->max_utf8_buffer_length(bytes.size() - total_read);
+      if (!needed) {
+        throw std::overflow_error("Overflow in buffer size computation.");
+      }
+    }
+  }
+
+  /**
+   * Like `decode_without_bom_handling()` but allocates the returned string
+   * from `resource`, e.g. an arena.
+   */
+  inline std::tuple<std::pmr::string, bool> decode_without_bom_handling(
+    gsl::span<const uint8_t> bytes,
+    std::pmr::memory_resource* resource) const
+  {
+    std::pmr::string string(resource);
+    bool had_errors = decode_without_bom_handling(bytes, string);
+    return { std::move(string), had_errors };
+  }
+
+  /**
+   * Like `decode_without_bom_handling()` but writes the output to the
+   * caller-allocated `dst` instead of allocating.
+   *
+   * Returns the number of bytes written and whether there were malformed
+   * sequences or `std::nullopt` if `dst` was too short, in which case its
+   * contents are unspecified. A `dst` of the length returned by
+   * `max_utf8_buffer_length()` of a decoder for this encoding is always
+   * long enough.
+   */
+  inline std::optional<std::tuple<size_t, bool>>
+  decode_without_bom_handling_into(gsl::span<const uint8_t> bytes,
+                                   gsl::span<uint8_t> dst) const
+  {
+    size_t as_is = decodes_as_is_up_to(bytes);
+    if (as_is > static_cast<size_t>(dst.size())) {
+      return std::nullopt;
+    }
+    copy_prefix(bytes.first(as_is), dst.data());
+    if (as_is == static_cast<size_t>(bytes.size())) {
+      return std::make_tuple(as_is, false);
+    }
+    auto decoder = pooled_decoder_without_bom_handling();
+    const auto [result, read, written, had_errors] =
+      decoder->decode_to_utf8(bytes.subspan(as_is), dst.subspan(as_is), true);
+    if (result != INPUT_EMPTY) {
+      return std::nullopt;
+    }
+    assert(as_is + read == static_cast<size_t>(bytes.size()));
+    return std::make_tuple(as_is + written, had_errors);
   }
 
   /**
@@ -957,25 +1274,110 @@ public:
   decode_without_bom_handling_and_without_replacement(
     gsl::span<const uint8_t> bytes) const
   {
-    auto decoder = new_decoder_without_bom_handling();
-    auto needed =
-      decoder->max_utf8_buffer_length_without_replacement(bytes.size());
+    size_t as_is = decodes_as_is_up_to(bytes);
+    if (as_is == static_cast<size_t>(bytes.size())) {
+      return std::string(reinterpret_cast<const char*>(bytes.data()), as_is);
+    }
+    auto decoder = pooled_decoder_without_bom_handling();
+    auto needed = decoder->max_utf8_buffer_length_without_replacement(
+      bytes.size() - as_is);
     if (!needed) {
       throw std::overflow_error("Overflow in buffer size computation.");
     }
-    std::string string(needed.value(), '\0');
+    std::string string(as_is + needed.value(), '\0');
+    copy_prefix(bytes.first(as_is), string.data());
     const auto [result, read, written] =
       decoder->decode_to_utf8_without_replacement(
-        bytes,
-        gsl::make_span(reinterpret_cast<uint8_t*>(&string[0]), string.size()),
+        bytes.subspan(as_is),
+        gsl::make_span(reinterpret_cast<uint8_t*>(&string[as_is]),
+                       needed.value()),
         true);
     assert(result != OUTPUT_FULL);
     if (result == INPUT_EMPTY) {
-      assert(read == static_cast<size_t>(bytes.size()));
-      assert(written <= static_cast<size_t>(string.size()));
-      string.resize(written);
+      assert(as_is + read == static_cast<size_t>(bytes.size()));
+      assert(written <= needed.value());
+      string.resize(as_is + written);
       return string;
     }
+    return std::nullopt;
+  }
+
+  /**
+   * Like `decode()` but returns a view into `bytes` instead of a copy when
+   * the input after the BOM, if any, decodes to itself, e.g. when the
+   * encoding is UTF-8 and the input is valid UTF-8 or when the encoding is
+   * ASCII-compatible and the input is ASCII.
+   */
+  inline std::tuple<CowString, gsl::not_null<const Encoding*>, bool>
+  decode_borrowing(gsl::span<const uint8_t> bytes) const
+  {
+    auto opt = Encoding::for_bom(bytes);
+    const Encoding* encoding;
+    if (opt) {
+      size_t bom_length;
+      std::tie(encoding, bom_length) = *opt;
+      bytes = bytes.subspan(bom_length);
+    } else {
+      encoding = this;
+    }
+    auto [str, had_errors] =
+      encoding->decode_without_bom_handling_borrowing(bytes);
+    return { std::move(str),
+             gsl::not_null<const Encoding*>(encoding),
+             had_errors };
+  }
+
+  /**
+   * Like `decode_with_bom_removal()` but returns a view into `bytes`
+   * instead of a copy when the input after the BOM, if any, decodes to
+   * itself.
+   */
+  inline std::tuple<CowString, bool> decode_with_bom_removal_borrowing(
+    gsl::span<const uint8_t> bytes) const
+  {
+    return decode_without_bom_handling_borrowing(
+      bytes.subspan(own_bom_length(bytes)));
+  }
+
+  /**
+   * Like `decode_without_bom_handling()` but returns a view into `bytes`
+   * instead of a copy when the input decodes to itself (see
+   * `decodes_as_is_up_to()`).
+   */
+  inline std::tuple<CowString, bool> decode_without_bom_handling_borrowing(
+    gsl::span<const uint8_t> bytes) const
+  {
+    size_t as_is = decodes_as_is_up_to(bytes);
+    if (as_is == static_cast<size_t>(bytes.size())) {
+      return { CowString(std::string_view(
+                 reinterpret_cast<const char*>(bytes.data()), as_is)),
+               false };
+    }
+    // The rest starts with a byte that doesn't decode to itself, so
+    // decoding it doesn't scan the prefix again.
+    std::string string(reinterpret_cast<const char*>(bytes.data()), as_is);
+    bool had_errors = decode_without_bom_handling(bytes.subspan(as_is), string);
+    return { CowString(std::move(string)), had_errors };
+  }
+
+  /**
+   * Like `decode_without_bom_handling_and_without_replacement()` but
+   * returns a view into `bytes` instead of a copy when the input decodes to
+   * itself.
+   */
+  inline std::optional<CowString>
+  decode_without_bom_handling_and_without_replacement_borrowing(
+    gsl::span<const uint8_t> bytes) const
+  {
+    if (decodes_as_is_up_to(bytes) == static_cast<size_t>(bytes.size())) {
+      return CowString(std::string_view(
+        reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+    }
+    auto string = decode_without_bom_handling_and_without_replacement(bytes);
+    if (!string) {
+      return std::nullopt;
+    }
+    return CowString(std::move(*string));
   }
 
   /**
@@ -1010,7 +1412,9 @@ public:
       encoding = this;
     }
     auto [str, had_errors] = encoding->decode16_without_bom_handling(bytes);
-    return { str, gsl::not_null<const Encoding*>(encoding), had_errors };
+    return { std::move(str),
+             gsl::not_null<const Encoding*>(encoding),
+             had_errors };
   }
 
   /**
@@ -1033,19 +1437,7 @@ public:
   inline std::tuple<std::u16string, bool> decode16_with_bom_removal(
     gsl::span<const uint8_t> bytes) const
   {
-    if (this == UTF_8_ENCODING && bytes.size() >= 3 &&
-        (gsl::as_bytes(bytes.first<3>()) ==
-         gsl::as_bytes(gsl::make_span("\xEF\xBB\xBF")))) {
-      bytes = bytes.subspan(3, bytes.size() - 3);
-    } else if (this == UTF_16LE_ENCODING && bytes.size() >= 2 &&
-               (gsl::as_bytes(bytes.first<2>()) ==
-                gsl::as_bytes(gsl::make_span("\xFF\xFE")))) {
-      bytes = bytes.subspan(2, bytes.size() - 2);
-    } else if (this == UTF_16BE_ENCODING && bytes.size() >= 2 &&
-               (gsl::as_bytes(bytes.first<2>()) ==
-                gsl::as_bytes(gsl::make_span("\xFE\xFF")))) {
-      bytes = bytes.subspan(2, bytes.size() - 2);
-    }
+    bytes = bytes.subspan(own_bom_length(bytes));
     return decode16_without_bom_handling(bytes);
   }
 
@@ -1069,19 +1461,98 @@ public:
   inline std::tuple<std::u16string, bool> decode16_without_bom_handling(
     gsl::span<const uint8_t> bytes) const
   {
-    auto decoder = new_decoder_without_bom_handling();
-    auto needed = decoder->max_utf16_buffer_length(bytes.size());
+    std::u16string string;
+    bool had_errors = decode16_without_bom_handling(bytes, string);
+    return { std::move(string), had_errors };
+  }
+
+  /**
+   * Like `decode16_without_bom_handling()` but appends the output to
+   * `string` (e.g. a `std::u16string` or a `std::pmr::u16string`) instead
+   * of returning a new string and returns only whether there were malformed
+   * sequences.
+   *
+   * The ASCII prefix of the input in an ASCII-compatible encoding is
+   * widened without a decoder. Unlike when decoding to UTF-8, the worst
+   * case is never much longer than the input, so there is no measuring
+   * pass.
+   */
+  template<class Allocator>
+  inline bool decode16_without_bom_handling(
+    gsl::span<const uint8_t> bytes,
+    std::basic_string<char16_t, std::char_traits<char16_t>, Allocator>& string)
+    const
+  {
+    size_t ascii = ascii_prefix_length(bytes);
+    size_t start = string.size();
+    if (ascii == static_cast<size_t>(bytes.size())) {
+      string.resize(start + ascii);
+      copy_prefix(bytes, string.data() + start);
+      return false;
+    }
+    auto decoder = pooled_decoder_without_bom_handling();
+    auto needed = decoder->max_utf16_buffer_length(bytes.size() - ascii);
     if (!needed) {
       throw std::overflow_error("Overflow in buffer size computation.");
     }
-    std::u16string string(needed.value(), '\0');
-    const auto [result, read, written, had_errors] = decoder->decode_to_utf16(
-      bytes, gsl::make_span(&string[0], string.size()), true);
-    assert(read == static_cast<size_t>(bytes.size()));
-    assert(written <= static_cast<size_t>(string.size()));
+    string.resize(start + ascii + needed.value());
+    copy_prefix(bytes.first(ascii), string.data() + start);
+    start += ascii;
+    const auto [result, read, written, had_errors] =
+      decoder->decode_to_utf16(bytes.subspan(ascii),
+                               gsl::make_span(string.data() + start,
+                                              needed.value()),
+                               true);
+    assert(ascii + read == static_cast<size_t>(bytes.size()));
+    assert(written <= needed.value());
     assert(result == INPUT_EMPTY);
-    string.resize(written);
-    return { string, had_errors };
+    string.resize(start + written);
+    return had_errors;
+  }
+
+  /**
+   * Like `decode16_without_bom_handling()` but allocates the returned
+   * string from `resource`, e.g. an arena.
+   */
+  inline std::tuple<std::pmr::u16string, bool> decode16_without_bom_handling(
+    gsl::span<const uint8_t> bytes,
+    std::pmr::memory_resource* resource) const
+  {
+    std::pmr::u16string string(resource);
+    bool had_errors = decode16_without_bom_handling(bytes, string);
+    return { std::move(string), had_errors };
+  }
+
+  /**
+   * Like `decode16_without_bom_handling()` but writes the output to the
+   * caller-allocated `dst` instead of allocating.
+   *
+   * Returns the number of code units written and whether there were
+   * malformed sequences or `std::nullopt` if `dst` was too short, in which
+   * case its contents are unspecified. A `dst` of the length returned by
+   * `max_utf16_buffer_length()` of a decoder for this encoding is always
+   * long enough.
+   */
+  inline std::optional<std::tuple<size_t, bool>>
+  decode16_without_bom_handling_into(gsl::span<const uint8_t> bytes,
+                                     gsl::span<char16_t> dst) const
+  {
+    size_t ascii = ascii_prefix_length(bytes);
+    if (ascii > static_cast<size_t>(dst.size())) {
+      return std::nullopt;
+    }
+    copy_prefix(bytes.first(ascii), dst.data());
+    if (ascii == static_cast<size_t>(bytes.size())) {
+      return std::make_tuple(ascii, false);
+    }
+    auto decoder = pooled_decoder_without_bom_handling();
+    const auto [result, read, written, had_errors] =
+      decoder->decode_to_utf16(bytes.subspan(ascii), dst.subspan(ascii), true);
+    if (result != INPUT_EMPTY) {
+      return std::nullopt;
+    }
+    assert(ascii + read == static_cast<size_t>(bytes.size()));
+    return std::make_tuple(ascii + written, had_errors);
   }
 
   /**
@@ -1106,22 +1577,62 @@ public:
   decode16_without_bom_handling_and_without_replacement(
     gsl::span<const uint8_t> bytes) const
   {
-    auto decoder = new_decoder_without_bom_handling();
-    auto needed = decoder->max_utf16_buffer_length(bytes.size());
+    size_t ascii = ascii_prefix_length(bytes);
+    if (ascii == static_cast<size_t>(bytes.size())) {
+      std::u16string string(ascii, '\0');
+      copy_prefix(bytes, string.data());
+      return string;
+    }
+    auto decoder = pooled_decoder_without_bom_handling();
+    auto needed = decoder->max_utf16_buffer_length(bytes.size() - ascii);
     if (!needed) {
       throw std::overflow_error("Overflow in buffer size computation.");
     }
-    std::u16string string(needed.value(), '\0');
+    std::u16string string(ascii + needed.value(), '\0');
+    copy_prefix(bytes.first(ascii), string.data());
     const auto [result, read, written] =
       decoder->decode_to_utf16_without_replacement(
-        bytes, gsl::make_span(&string[0], string.size()), true);
+        bytes.subspan(ascii),
+        gsl::make_span(&string[ascii], needed.value()),
+        true);
     assert(result != OUTPUT_FULL);
     if (result == INPUT_EMPTY) {
-      assert(read == static_cast<size_t>(bytes.size()));
-      assert(written <= static_cast<size_t>(string.size()));
-      string.resize(written);
+      assert(ascii + read == static_cast<size_t>(bytes.size()));
+      assert(written <= needed.value());
+      string.resize(ascii + written);
       return string;
     }
+    return std::nullopt;
+  }
+
+  /**
+   * Decodes each value of a column of strings in this encoding (see
+   * `StringColumn`) to UTF-8 _without BOM handling_ and with malformed
+   * sequences replaced with the REPLACEMENT CHARACTER, as
+   * `decode_without_bom_handling()` would decode the values one by one.
+   *
+   * `offsets` has one more entry than there are values. It need not start
+   * at zero, but it must not decrease or point past the end of `values`;
+   * otherwise `std::out_of_range` is thrown. If the decoded values don't
+   * fit the range of `Offset`, `std::overflow_error` is thrown.
+   *
+   * Runs of values that decode to themselves (see `decodes_as_is_up_to()`)
+   * are copied as one block. The other values are decoded by one decoder
+   * that is reset before each value. With `threads` greater than one, the
+   * rows are split into that many ranges of about equal byte length, each
+   * a multiple of eight rows long except the last, which are decoded on
+   * threads of their own and then concatenated.
+   */
+  template<class Offset>
+  inline StringColumn<Offset> decode_column(gsl::span<const uint8_t> values,
+                                            gsl::span<const Offset> offsets,
+                                            unsigned threads = 1) const
+  {
+    check_offsets(values, offsets);
+    return convert_column(
+      offsets, threads, [&](gsl::span<const Offset> part_offsets) {
+        return decode_rows(values, part_offsets);
+      });
   }
 
   /**
@@ -1147,47 +1658,132 @@ public:
    */
   inline std::tuple<std::vector<uint8_t>, gsl::not_null<const Encoding*>, bool>
   encode(std::string_view string) const
+  {
+    std::vector<uint8_t> vec;
+    auto [output_enc, had_errors] = encode(string, vec);
+    return { std::move(vec), output_enc, had_errors };
+  }
+
+  /**
+   * Like `encode()` but appends the output to `vec` (e.g. a
+   * `std::vector<uint8_t>` or a `std::pmr::vector<uint8_t>`) instead of
+   * returning a new vector and returns only the encoding that was actually
+   * used and whether there were unmappable characters.
+   *
+   * The prefix that encodes to itself (see `encodes_as_is_up_to()`) and
+   * the rest are handled as when decoding with
+   * `decode_without_bom_handling()`, except that the space may also need
+   * to grow while encoding if there are unmappable characters.
+   */
+  template<class Allocator>
+  inline std::tuple<gsl::not_null<const Encoding*>, bool> encode(
+    std::string_view string,
+    std::vector<uint8_t, Allocator>& vec) const
   {
     auto output_enc = output_encoding();
-    if (output_enc == UTF_8_ENCODING) {
-      std::vector<uint8_t> vec(string.size());
-      std::memcpy(&vec[0], string.data(), string.size());
+    size_t as_is = output_enc->encodes_as_is_up_to(string);
+    if (as_is == string.size()) {
+      vec.insert(vec.end(), string.begin(), string.end());
+      return { output_enc, false };
     }
-    auto encoder = output_enc->new_encoder();
+    std::string_view prefix = string.substr(0, as_is);
+    string = string.substr(as_is);
+    auto encoder = output_enc->pooled_encoder();
     auto needed =
       encoder->max_buffer_length_from_utf8_if_no_unmappables(string.size());
     if (!needed) {
       throw std::overflow_error("Overflow in buffer size computation.");
     }
-    std::vector<uint8_t> vec(needed.value());
+    if (worth_measuring(string.size(), needed.value())) {
+      size_t total_read = 0;
+      needed = measure([&](gsl::span<uint8_t> scratch) {
+        const auto [result, read, written, had_errors] =
+          encoder->encode_from_utf8(string.substr(total_read), scratch, true);
+        total_read += read;
+        return std::make_tuple(result, written);
+      }) + MEASURE_SLACK;
+      output_enc->new_encoder_into(*encoder);
+    }
+    size_t start = vec.size();
+    vec.resize(start + prefix.size() + needed.value());
+    copy_prefix(prefix, vec.data() + start);
+    start += prefix.size();
     bool total_had_errors = false;
     size_t total_read = 0;
     size_t total_written = 0;
     for (;;) {
+      vec.resize(start + total_written + needed.value());
       const auto [result, read, written, had_errors] =
-        encoder->encode_from_utf8(string.substr(total_read),
-                                  gsl::make_span(vec).subspan(total_written),
-                                  true);
+        encoder->encode_from_utf8(
+          string.substr(total_read),
+          gsl::make_span(vec.data() + start + total_written, needed.value()),
+          true);
       total_read += read;
       total_written += written;
       total_had_errors |= had_errors;
       if (result == INPUT_EMPTY) {
         assert(total_read == static_cast<size_t>(string.size()));
-        assert(total_written <= static_cast<size_t>(vec.size()));
-        vec.resize(total_written);
-        return { vec,
-                 gsl::not_null<const Encoding*>(output_enc),
-                 total_had_errors };
+        vec.resize(start + total_written);
+        return { output_enc, total_had_errors };
       }
-      auto needed = encoder->max_buffer_length_from_utf8_if_no_unmappables(
+      needed = encoder->max_buffer_length_from_utf8_if_no_unmappables(
         string.size() - total_read);
       if (!needed) {
         throw std::overflow_error("Overflow in buffer size computation.");
       }
-      vec.resize(total_written + needed.value());
     }
   }
 
+  /**
+   * Like `encode()` but allocates the returned vector from `resource`, e.g.
+   * an arena.
+   */
+  inline std::
+    tuple<std::pmr::vector<uint8_t>, gsl::not_null<const Encoding*>, bool>
+    encode(std::string_view string, std::pmr::memory_resource* resource) const
+  {
+    std::pmr::vector<uint8_t> vec(resource);
+    auto [output_enc, had_errors] = encode(string, vec);
+    return { std::move(vec), output_enc, had_errors };
+  }
+
+  /**
+   * Like `encode()` but writes the output to the caller-allocated `dst`
+   * instead of allocating.
+   *
+   * Returns the number of bytes written, the encoding that was actually
+   * used and whether there were unmappable characters or `std::nullopt` if
+   * `dst` was too short, in which case its contents are unspecified.
+   * Without unmappable characters, a `dst` of the length returned by
+   * `max_buffer_length_from_utf8_if_no_unmappables()` of an encoder for
+   * this encoding is long enough.
+   */
+  inline std::optional<
+    std::tuple<size_t, gsl::not_null<const Encoding*>, bool>>
+  encode_into(std::string_view string, gsl::span<uint8_t> dst) const
+  {
+    auto output_enc = output_encoding();
+    size_t as_is = output_enc->encodes_as_is_up_to(string);
+    if (as_is > static_cast<size_t>(dst.size())) {
+      return std::nullopt;
+    }
+    copy_prefix(string.substr(0, as_is), dst.data());
+    if (as_is == string.size()) {
+      return std::make_tuple(
+        as_is, gsl::not_null<const Encoding*>(output_enc), false);
+    }
+    auto encoder = output_enc->pooled_encoder();
+    const auto [result, read, written, had_errors] =
+      encoder->encode_from_utf8(string.substr(as_is), dst.subspan(as_is), true);
+    if (result != INPUT_EMPTY) {
+      return std::nullopt;
+    }
+    assert(as_is + read == static_cast<size_t>(string.size()));
+    return std::make_tuple(as_is + written,
+                           gsl::not_null<const Encoding*>(output_enc),
+                           had_errors);
+  }
+
   /**
    * Encode complete input to `std::vector<uint8_t>` with unmappable characters
    * replaced with decimal numeric character references when the entire input
@@ -1211,43 +1807,167 @@ public:
    */
   inline std::tuple<std::vector<uint8_t>, gsl::not_null<const Encoding*>, bool>
   encode(std::u16string_view string) const
+  {
+    std::vector<uint8_t> vec;
+    auto [output_enc, had_errors] = encode(string, vec);
+    return { std::move(vec), output_enc, had_errors };
+  }
+
+  /**
+   * Like `encode()` but appends the output to `vec` (e.g. a
+   * `std::vector<uint8_t>` or a `std::pmr::vector<uint8_t>`) instead of
+   * returning a new vector and returns only the encoding that was actually
+   * used and whether there were unmappable characters.
+   *
+   * Space for the output is allocated as when encoding from UTF-8 but only
+   * an ASCII prefix is narrowed without an encoder.
+   */
+  template<class Allocator>
+  inline std::tuple<gsl::not_null<const Encoding*>, bool> encode(
+    std::u16string_view string,
+    std::vector<uint8_t, Allocator>& vec) const
   {
     auto output_enc = output_encoding();
-    auto encoder = output_enc->new_encoder();
+    size_t as_is = output_enc->encodes_as_is_up_to(string);
+    size_t start = vec.size();
+    if (as_is == string.size()) {
+      vec.resize(start + as_is);
+      copy_prefix(string, vec.data() + start);
+      return { output_enc, false };
+    }
+    std::u16string_view prefix = string.substr(0, as_is);
+    string = string.substr(as_is);
+    auto encoder = output_enc->pooled_encoder();
     auto needed =
       encoder->max_buffer_length_from_utf16_if_no_unmappables(string.size());
     if (!needed) {
       throw std::overflow_error("Overflow in buffer size computation.");
     }
-    std::vector<uint8_t> vec(needed.value());
+    if (worth_measuring(string.size(), needed.value())) {
+      size_t total_read = 0;
+      needed = measure([&](gsl::span<uint8_t> scratch) {
+        const auto [result, read, written, had_errors] =
+          encoder->encode_from_utf16(string.substr(total_read), scratch, true);
+        total_read += read;
+        return std::make_tuple(result, written);
+      }) + MEASURE_SLACK;
+      output_enc->new_encoder_into(*encoder);
+    }
+    vec.resize(start + prefix.size() + needed.value());
+    copy_prefix(prefix, vec.data() + start);
+    start += prefix.size();
     bool total_had_errors = false;
     size_t total_read = 0;
     size_t total_written = 0;
     for (;;) {
+      vec.resize(start + total_written + needed.value());
       const auto [result, read, written, had_errors] =
-        encoder->encode_from_utf16(string.substr(total_read),
-                                   gsl::make_span(vec).subspan(total_written),
-                                   true);
+        encoder->encode_from_utf16(
+          string.substr(total_read),
+          gsl::make_span(vec.data() + start + total_written, needed.value()),
+          true);
       total_read += read;
       total_written += written;
       total_had_errors |= had_errors;
       if (result == INPUT_EMPTY) {
         assert(total_read == static_cast<size_t>(string.size()));
-        assert(total_written <= static_cast<size_t>(vec.size()));
-        vec.resize(total_written);
-        return { vec,
-                 gsl::not_null<const Encoding*>(output_enc),
-                 total_had_errors };
+        vec.resize(start + total_written);
+        return { output_enc, total_had_errors };
       }
-      auto needed = encoder->max_buffer_length_from_utf16_if_no_unmappables(
+      needed = encoder->max_buffer_length_from_utf16_if_no_unmappables(
         string.size() - total_read);
       if (!needed) {
         throw std::overflow_error("Overflow in buffer size computation.");
       }
-      vec.resize(total_written + needed.value());
     }
   }
 
+  /**
+   * Like `encode()` but allocates the returned vector from `resource`, e.g.
+   * an arena.
+   */
+  inline std::
+    tuple<std::pmr::vector<uint8_t>, gsl::not_null<const Encoding*>, bool>
+    encode(std::u16string_view string,
+           std::pmr::memory_resource* resource) const
+  {
+    std::pmr::vector<uint8_t> vec(resource);
+    auto [output_enc, had_errors] = encode(string, vec);
+    return { std::move(vec), output_enc, had_errors };
+  }
+
+  /**
+   * Like `encode()` but writes the output to the caller-allocated `dst`
+   * instead of allocating.
+   *
+   * Returns the number of bytes written, the encoding that was actually
+   * used and whether there were unmappable characters or `std::nullopt` if
+   * `dst` was too short, in which case its contents are unspecified.
+   * Without unmappable characters, a `dst` of the length returned by
+   * `max_buffer_length_from_utf16_if_no_unmappables()` of an encoder for
+   * this encoding is long enough.
+   */
+  inline std::optional<
+    std::tuple<size_t, gsl::not_null<const Encoding*>, bool>>
+  encode_into(std::u16string_view string, gsl::span<uint8_t> dst) const
+  {
+    auto output_enc = output_encoding();
+    size_t as_is = output_enc->encodes_as_is_up_to(string);
+    if (as_is > static_cast<size_t>(dst.size())) {
+      return std::nullopt;
+    }
+    copy_prefix(string.substr(0, as_is), dst.data());
+    if (as_is == string.size()) {
+      return std::make_tuple(
+        as_is, gsl::not_null<const Encoding*>(output_enc), false);
+    }
+    auto encoder = output_enc->pooled_encoder();
+    const auto [result, read, written, had_errors] = encoder->encode_from_utf16(
+      string.substr(as_is), dst.subspan(as_is), true);
+    if (result != INPUT_EMPTY) {
+      return std::nullopt;
+    }
+    assert(as_is + read == static_cast<size_t>(string.size()));
+    return std::make_tuple(as_is + written,
+                           gsl::not_null<const Encoding*>(output_enc),
+                           had_errors);
+  }
+
+  /**
+   * Encodes each value of a column of UTF-8 strings (see `StringColumn`)
+   * with unmappable characters replaced with decimal numeric character
+   * references, as `encode()` would encode the values one by one. Each
+   * value must be valid UTF-8.
+   *
+   * Returns the column and the encoding that was actually used. The
+   * requirements on `offsets` and the exceptions are as with
+   * `decode_column()`.
+   *
+   * The output buffer of each range of rows is allocated once, for the
+   * worst case without unmappable characters, and only grows if there are
+   * unmappable characters. Runs of values that encode to themselves (see
+   * `encodes_as_is_up_to()`) are copied as one block. The other values are
+   * encoded by one encoder that is reset before each value. `threads`
+   * works as with `decode_column()`.
+   */
+  template<class Offset>
+  inline std::tuple<StringColumn<Offset>, gsl::not_null<const Encoding*>>
+  encode_column(std::string_view values,
+                gsl::span<const Offset> offsets,
+                unsigned threads = 1) const
+  {
+    auto output_enc = output_encoding();
+    check_offsets(gsl::make_span(
+                    reinterpret_cast<const uint8_t*>(values.data()),
+                    values.size()),
+                  offsets);
+    StringColumn<Offset> column = convert_column(
+      offsets, threads, [&](gsl::span<const Offset> part_offsets) {
+        return output_enc->encode_rows(values, part_offsets);
+      });
+    return { std::move(column), output_enc };
+  }
+
   /**
    * Instantiates a new decoder for this encoding with BOM sniffing enabled.
    *
@@ -1353,6 +2073,67 @@ public:
     encoding_new_encoder_into(this, &encoder);
   }
 
+  /**
+   * Like `new_decoder()` but reuses an idle decoder from the calling
+   * thread's `CoderPool` if there is one. The decoder goes back to the pool
+   * when the returned pointer is destroyed.
+   */
+  inline PooledDecoder pooled_decoder() const
+  {
+    Decoder* decoder = CoderPool<Decoder>::take();
+    if (!decoder) {
+      return PooledDecoder(encoding_new_decoder(this));
+    }
+    new_decoder_into(*decoder);
+    return PooledDecoder(decoder);
+  }
+
+  /**
+   * Like `new_decoder_with_bom_removal()` but reuses an idle decoder from
+   * the calling thread's `CoderPool` if there is one. The decoder goes back
+   * to the pool when the returned pointer is destroyed.
+   */
+  inline PooledDecoder pooled_decoder_with_bom_removal() const
+  {
+    Decoder* decoder = CoderPool<Decoder>::take();
+    if (!decoder) {
+      return PooledDecoder(encoding_new_decoder_with_bom_removal(this));
+    }
+    new_decoder_with_bom_removal_into(*decoder);
+    return PooledDecoder(decoder);
+  }
+
+  /**
+   * Like `new_decoder_without_bom_handling()` but reuses an idle decoder
+   * from the calling thread's `CoderPool` if there is one. The decoder goes
+   * back to the pool when the returned pointer is destroyed.
+   */
+  inline PooledDecoder pooled_decoder_without_bom_handling() const
+  {
+    Decoder* decoder = CoderPool<Decoder>::take();
+    if (!decoder) {
+      return PooledDecoder(
+        encoding_new_decoder_without_bom_handling(this));
+    }
+    new_decoder_without_bom_handling_into(*decoder);
+    return PooledDecoder(decoder);
+  }
+
+  /**
+   * Like `new_encoder()` but reuses an idle encoder from the calling
+   * thread's `CoderPool` if there is one. The encoder goes back to the pool
+   * when the returned pointer is destroyed.
+   */
+  inline PooledEncoder pooled_encoder() const
+  {
+    Encoder* encoder = CoderPool<Encoder>::take();
+    if (!encoder) {
+      return PooledEncoder(encoding_new_encoder(this));
+    }
+    new_encoder_into(*encoder);
+    return PooledEncoder(encoder);
+  }
+
   /**
    * Validates UTF-8.
    *
@@ -1392,7 +2173,501 @@ public:
       null_to_bogus<const uint8_t>(buffer.data()), buffer.size());
   }
 
+  /**
+   * Returns the length of the prefix of `bytes` that decodes to the same
+   * bytes in UTF-8 in this encoding, i.e. that the one-shot decoding
+   * methods copy instead of running through a decoder: the valid prefix
+   * for UTF-8, the part that stays in the ASCII state for ISO-2022-JP, the
+   * ASCII prefix for the other ASCII-compatible encodings and zero for the
+   * rest.
+   */
+  inline size_t decodes_as_is_up_to(gsl::span<const uint8_t> bytes) const
+  {
+    if (this == UTF_8_ENCODING) {
+      return utf8_valid_up_to(bytes);
+    }
+    if (this == ISO_2022_JP_ENCODING) {
+      return iso_2022_jp_ascii_valid_up_to(bytes);
+    }
+    return ascii_prefix_length(bytes);
+  }
+
+  /**
+   * Returns the length of the prefix of `string` that encodes to the same
+   * bytes in this encoding, i.e. that the one-shot encoding methods copy
+   * instead of running through an encoder: all of it for UTF-8, the part
+   * representable in the ASCII state for ISO-2022-JP and the ASCII prefix
+   * for the other encodings that are the output encoding of some encoding.
+   */
+  inline size_t encodes_as_is_up_to(std::string_view string) const
+  {
+    if (this == UTF_8_ENCODING) {
+      return string.size();
+    }
+    auto bytes = gsl::make_span(
+      reinterpret_cast<const uint8_t*>(string.data()), string.size());
+    if (this == ISO_2022_JP_ENCODING) {
+      return iso_2022_jp_ascii_valid_up_to(bytes);
+    }
+    return ascii_prefix_length(bytes);
+  }
+
+  /**
+   * Returns the length of the ASCII prefix of `string` if that encodes to
+   * the same bytes in this encoding. Like `encodes_as_is_up_to()` for
+   * UTF-8 except that the prefix is always ASCII.
+   */
+  inline size_t encodes_as_is_up_to(std::u16string_view string) const
+  {
+    if (!is_ascii_compatible() && this != ISO_2022_JP_ENCODING) {
+      return 0;
+    }
+    // Four units at a time with one test of the bits that make a unit
+    // non-ASCII.
+    size_t i = 0;
+    for (; i + 4 <= string.size(); i += 4) {
+      uint64_t units;
+      std::memcpy(&units, string.data() + i, sizeof(units));
+      if (units & 0xFF80FF80FF80FF80) {
+        break;
+      }
+    }
+    for (; i < string.size() && string[i] < 0x80; i++) {
+    }
+    if (this == ISO_2022_JP_ENCODING) {
+      // The ESC, SO and SI bytes are not representable in the ASCII state.
+      for (size_t j = 0; j < i; j++) {
+        if (string[j] == 0x1B || string[j] == 0x0E || string[j] == 0x0F) {
+          return j;
+        }
+      }
+    }
+    return i;
+  }
+
+  /**
+   * The input length (in code units) from which the one-shot methods that
+   * append to a container measure the output with a first pass instead of
+   * allocating for a worst case more than a quarter longer than the input.
+   */
+  static constexpr size_t TWO_PASS_THRESHOLD = 64 * 1024;
+
 private:
+  /**
+   * The length of the stack buffer that the measuring pass converts into.
+   */
+  static constexpr size_t MEASURE_SCRATCH_LENGTH = 8 * 1024;
+
+  /**
+   * Space allocated beyond the measured length, since decoders and encoders
+   * stop when the space left might not fit the worst case for the next
+   * character (e.g. a numeric character reference) even if the actual
+   * output would fit.
+   */
+  static constexpr size_t MEASURE_SLACK = 16;
+
+  /**
+   * Returns the length of the BOM of this encoding at the start of `bytes`
+   * or zero if there is none.
+   */
+  inline size_t own_bom_length(gsl::span<const uint8_t> bytes) const
+  {
+    if (this == UTF_8_ENCODING && bytes.size() >= 3 && bytes[0] == 0xEF &&
+        bytes[1] == 0xBB && bytes[2] == 0xBF) {
+      return 3;
+    }
+    if (this == UTF_16LE_ENCODING && bytes.size() >= 2 && bytes[0] == 0xFF &&
+        bytes[1] == 0xFE) {
+      return 2;
+    }
+    if (this == UTF_16BE_ENCODING && bytes.size() >= 2 && bytes[0] == 0xFE &&
+        bytes[1] == 0xFF) {
+      return 2;
+    }
+    return 0;
+  }
+
+  inline size_t ascii_prefix_length(gsl::span<const uint8_t> bytes) const
+  {
+    return is_ascii_compatible() ? ascii_valid_up_to(bytes) : 0;
+  }
+
+  /**
+   * Copies a prefix that converts to itself to the start of `dst`, widening
+   * or narrowing ASCII between bytes and UTF-16 code units.
+   */
+  static inline void copy_prefix(gsl::span<const uint8_t> prefix, void* dst)
+  {
+    if (!prefix.empty()) {
+      std::memcpy(dst, prefix.data(), prefix.size());
+    }
+  }
+
+  static inline void copy_prefix(std::string_view prefix, void* dst)
+  {
+    if (!prefix.empty()) {
+      std::memcpy(dst, prefix.data(), prefix.size());
+    }
+  }
+
+  static inline void copy_prefix(gsl::span<const uint8_t> prefix,
+                                 char16_t* dst)
+  {
+    for (size_t i = 0; i < static_cast<size_t>(prefix.size()); i++) {
+      dst[i] = prefix[i];
+    }
+  }
+
+  static inline void copy_prefix(std::u16string_view prefix, uint8_t* dst)
+  {
+    for (size_t i = 0; i < prefix.size(); i++) {
+      dst[i] = static_cast<uint8_t>(prefix[i]);
+    }
+  }
+
+  template<class Offset>
+  static inline void check_offsets(gsl::span<const uint8_t> values,
+                                   gsl::span<const Offset> offsets)
+  {
+    if (offsets.empty()) {
+      return;
+    }
+    if constexpr (std::is_signed_v<Offset>) {
+      if (offsets[0] < 0) {
+        throw std::out_of_range("Column offset out of range.");
+      }
+    }
+    for (size_t i = 1; i < static_cast<size_t>(offsets.size()); i++) {
+      if (offsets[i] < offsets[i - 1]) {
+        throw std::out_of_range("Column offset out of range.");
+      }
+    }
+    if (static_cast<uint64_t>(offsets[offsets.size() - 1]) >
+        static_cast<uint64_t>(values.size())) {
+      throw std::out_of_range("Column offset out of range.");
+    }
+  }
+
+  template<class Offset>
+  static inline Offset column_offset(size_t offset)
+  {
+    if (offset > static_cast<size_t>(std::numeric_limits<Offset>::max())) {
+      throw std::overflow_error("Overflow in column offset computation.");
+    }
+    return static_cast<Offset>(offset);
+  }
+
+  /**
+   * Returns the row indices at which the ranges of rows that are converted
+   * on threads of their own start, followed by `rows`. The ranges have
+   * about equal byte lengths and start at multiples of eight rows so that
+   * their bitmaps can be concatenated bytewise.
+   */
+  template<class Offset>
+  static inline std::vector<size_t> split_rows(gsl::span<const Offset> offsets,
+                                               size_t rows,
+                                               unsigned threads)
+  {
+    std::vector<size_t> splits{ 0 };
+    if (threads > 1 && rows >= 16) {
+      uint64_t first = static_cast<uint64_t>(offsets[0]);
+      uint64_t length = static_cast<uint64_t>(offsets[rows]) - first;
+      for (unsigned part = 1; part < threads; part++) {
+        uint64_t target = first + length * part / threads;
+        size_t row = std::lower_bound(offsets.begin(),
+                                      offsets.begin() + rows,
+                                      static_cast<Offset>(target)) -
+                     offsets.begin();
+        row &= ~static_cast<size_t>(7);
+        if (row > splits.back()) {
+          splits.push_back(row);
+        }
+      }
+    }
+    splits.push_back(rows);
+    return splits;
+  }
+
+  /**
+   * Converts the rows of `offsets` with `convert_rows`, which takes the
+   * offsets of a range of rows and returns them converted as a column of
+   * their own, splitting the rows among `threads` threads.
+   */
+  template<class Offset, class F>
+  static inline StringColumn<Offset> convert_column(
+    gsl::span<const Offset> offsets,
+    unsigned threads,
+    F convert_rows)
+  {
+    if (offsets.size() < 2) {
+      StringColumn<Offset> column;
+      column.offsets.push_back(0);
+      return column;
+    }
+    size_t rows = offsets.size() - 1;
+    std::vector<size_t> splits = split_rows(offsets, rows, threads);
+    std::vector<StringColumn<Offset>> parts(splits.size() - 1);
+    std::vector<std::exception_ptr> errors(parts.size());
+    auto convert_part = [&](size_t part) {
+      try {
+        parts[part] = convert_rows(
+          offsets.subspan(splits[part], splits[part + 1] - splits[part] + 1));
+      } catch (...) {
+        errors[part] = std::current_exception();
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t part = 1; part < parts.size(); part++) {
+      workers.emplace_back(convert_part, part);
+    }
+    convert_part(0);
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    for (std::exception_ptr& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+    return concatenate(std::move(parts));
+  }
+
+  /**
+   * Decodes the rows of `offsets`, which has one more entry than there are
+   * rows, into a column of their own.
+   */
+  template<class Offset>
+  inline StringColumn<Offset> decode_rows(
+    gsl::span<const uint8_t> values,
+    gsl::span<const Offset> offsets) const
+  {
+    StringColumn<Offset> column;
+    size_t rows = offsets.size() - 1;
+    column.offsets.reserve(rows + 1);
+    column.offsets.push_back(0);
+    column.had_errors.assign((rows + 7) / 8, 0);
+    size_t begin = static_cast<size_t>(offsets[0]);
+    size_t end = static_cast<size_t>(offsets[rows]);
+    column.values.reserve(end - begin);
+    PooledDecoder decoder;
+    // Where the as-is part found by the last scan ends. It ends there for
+    // any start before it that isn't in the middle of a UTF-8 character,
+    // so the bytes up to it aren't scanned again after a value that had
+    // to be decoded on its own.
+    size_t as_is_end = 0;
+    size_t row = 0;
+    while (row < rows) {
+      // Values that decode to themselves are copied together with the
+      // values that follow them up to the first value that doesn't.
+      size_t start = static_cast<size_t>(offsets[row]);
+      if (start >= as_is_end) {
+        as_is_end =
+          start + decodes_as_is_up_to(values.subspan(start, end - start));
+      }
+      size_t as_is = as_is_end;
+      if (start < as_is && (values[start] & 0xC0) == 0x80) {
+        as_is = start;
+      }
+      size_t run_end = row;
+      while (run_end < rows) {
+        size_t value_end = static_cast<size_t>(offsets[run_end + 1]);
+        // In UTF-8, a value may end in the middle of a character that
+        // the next value completes.
+        if (value_end > as_is ||
+            (value_end < as_is && (values[value_end] & 0xC0) == 0x80)) {
+          break;
+        }
+        run_end++;
+      }
+      if (run_end > row) {
+        size_t run_start = column.values.size();
+        size_t run_stop = static_cast<size_t>(offsets[run_end]);
+        column.values.insert(column.values.end(),
+                             values.begin() + start,
+                             values.begin() + run_stop);
+        for (size_t i = row + 1; i <= run_end; i++) {
+          column.offsets.push_back(column_offset<Offset>(
+            run_start + static_cast<size_t>(offsets[i]) - start));
+        }
+        row = run_end;
+        continue;
+      }
+      gsl::span<const uint8_t> value = values.subspan(
+        start, static_cast<size_t>(offsets[row + 1]) - start);
+      if (!decoder) {
+        decoder = pooled_decoder_without_bom_handling();
+      } else {
+        new_decoder_without_bom_handling_into(*decoder);
+      }
+      auto needed = decoder->max_utf8_buffer_length(value.size());
+      if (!needed) {
+        throw std::overflow_error("Overflow in buffer size computation.");
+      }
+      size_t value_start = column.values.size();
+      column.values.resize(value_start + needed.value());
+      const auto [result, read, written, had_errors] = decoder->decode_to_utf8(
+        value,
+        gsl::make_span(column.values.data() + value_start, needed.value()),
+        true);
+      assert(result == INPUT_EMPTY);
+      assert(read == static_cast<size_t>(value.size()));
+      column.values.resize(value_start + written);
+      column.offsets.push_back(column_offset<Offset>(column.values.size()));
+      if (had_errors) {
+        column.had_errors[row / 8] |= 1 << (row % 8);
+      }
+      row++;
+    }
+    return column;
+  }
+
+  /**
+   * Encodes the rows of `offsets` into a column of their own. Must be
+   * called on an output encoding.
+   */
+  template<class Offset>
+  inline StringColumn<Offset> encode_rows(std::string_view values,
+                                          gsl::span<const Offset> offsets) const
+  {
+    StringColumn<Offset> column;
+    size_t rows = offsets.size() - 1;
+    column.offsets.reserve(rows + 1);
+    column.offsets.push_back(0);
+    column.had_errors.assign((rows + 7) / 8, 0);
+    size_t end = static_cast<size_t>(offsets[rows]);
+    PooledEncoder encoder = pooled_encoder();
+    // Bounds the worst case for the input from `from` on, which belongs to
+    // the rows from `row` on: the worst case for its total length plus the
+    // worst case for an empty input for each row, which is what encoding
+    // the rows one by one adds.
+    auto worst_case = [&](size_t row, size_t from) {
+      auto total =
+        encoder->max_buffer_length_from_utf8_if_no_unmappables(end - from);
+      auto per_row = encoder->max_buffer_length_from_utf8_if_no_unmappables(0);
+      size_t rest = rows - row;
+      if (!total || !per_row ||
+          (per_row.value() &&
+           rest > (std::numeric_limits<size_t>::max() - total.value()) /
+                    per_row.value())) {
+        throw std::overflow_error("Overflow in buffer size computation.");
+      }
+      return total.value() + rest * per_row.value();
+    };
+    column.values.resize(worst_case(0, static_cast<size_t>(offsets[0])));
+    size_t written = 0;
+    size_t row = 0;
+    while (row < rows) {
+      // Values that encode to themselves are copied together with the
+      // values that follow them up to the first value that doesn't.
+      size_t start = static_cast<size_t>(offsets[row]);
+      size_t as_is =
+        start + encodes_as_is_up_to(values.substr(start, end - start));
+      size_t run_end = row;
+      while (run_end < rows &&
+             static_cast<size_t>(offsets[run_end + 1]) <= as_is) {
+        run_end++;
+      }
+      if (run_end > row) {
+        size_t run_stop = static_cast<size_t>(offsets[run_end]);
+        if (run_stop > start) {
+          std::memcpy(column.values.data() + written,
+                      values.data() + start,
+                      run_stop - start);
+        }
+        for (size_t i = row + 1; i <= run_end; i++) {
+          column.offsets.push_back(column_offset<Offset>(
+            written + static_cast<size_t>(offsets[i]) - start));
+        }
+        written += run_stop - start;
+        row = run_end;
+        continue;
+      }
+      std::string_view value =
+        values.substr(start, static_cast<size_t>(offsets[row + 1]) - start);
+      new_encoder_into(*encoder);
+      bool value_had_errors = false;
+      for (;;) {
+        const auto [result, read, value_written, had_errors] =
+          encoder->encode_from_utf8(
+            value,
+            gsl::make_span(column.values.data() + written,
+                           column.values.size() - written),
+            true);
+        value = value.substr(read);
+        written += value_written;
+        value_had_errors |= had_errors;
+        if (result == INPUT_EMPTY) {
+          break;
+        }
+        // Numeric character references took more than the worst case
+        // without unmappables. Grows geometrically in case many rows have
+        // them.
+        size_t from = static_cast<size_t>(offsets[row + 1]) - value.size();
+        column.values.resize(written + worst_case(row, from) +
+                             column.values.size() / 2);
+      }
+      column.offsets.push_back(column_offset<Offset>(written));
+      if (value_had_errors) {
+        column.had_errors[row / 8] |= 1 << (row % 8);
+      }
+      row++;
+    }
+    column.values.resize(written);
+    return column;
+  }
+
+  /**
+   * Concatenates columns of which all but the last have a multiple of
+   * eight rows.
+   */
+  template<class Offset>
+  static inline StringColumn<Offset> concatenate(
+    std::vector<StringColumn<Offset>>&& parts)
+  {
+    StringColumn<Offset> column = std::move(parts[0]);
+    for (size_t part = 1; part < parts.size(); part++) {
+      StringColumn<Offset>& next = parts[part];
+      assert(column.size() % 8 == 0);
+      size_t base = column.values.size();
+      column.values.insert(
+        column.values.end(), next.values.begin(), next.values.end());
+      for (size_t i = 1; i < next.offsets.size(); i++) {
+        column.offsets.push_back(
+          column_offset<Offset>(base + static_cast<size_t>(next.offsets[i])));
+      }
+      column.had_errors.insert(column.had_errors.end(),
+                               next.had_errors.begin(),
+                               next.had_errors.end());
+    }
+    return column;
+  }
+
+  static inline bool worth_measuring(size_t input_length, size_t worst_case)
+  {
+    return input_length >= TWO_PASS_THRESHOLD &&
+           worst_case > input_length + input_length / 4;
+  }
+
+  /**
+   * Calls `convert`, which continues a conversion into the given scratch
+   * space and returns the status and the number of bytes written, until
+   * the status is `INPUT_EMPTY` and returns the total number of bytes
+   * written.
+   */
+  template<class F>
+  static inline size_t measure(F convert)
+  {
+    uint8_t scratch[MEASURE_SCRATCH_LENGTH];
+    size_t total = 0;
+    for (;;) {
+      const auto [result, written] = convert(gsl::make_span(scratch));
+      total += written;
+      if (result == INPUT_EMPTY) {
+        return total;
+      }
+    }
+  }
+
   /**
    * Replaces `nullptr` with a bogus pointer suitable for use as part of a
    * zero-length Rust slice.
@@ -1409,6 +2684,338 @@ private:
   ~Encoding() = delete;
 };
 
+/**
+ * A `Decoder` and an `Encoder` driven as one converter from bytes in one
+ * encoding to bytes in another.
+ *
+ * Calling `Decoder::decode_to_utf8()` on a large buffer and then
+ * `Encoder::encode_from_utf8()` on its output moves the whole intermediate
+ * buffer through the cache twice. `transcode()` instead decodes at most
+ * `TILE_SIZE` bytes of UTF-8 (or UTF-16) at a time into a tile that stays
+ * in the L1 cache and encodes the tile before decoding more. When the
+ * encoder is for UTF-8 and the tile is UTF-8, the decoder writes straight
+ * to the output.
+ *
+ * When both encodings are single-byte, the decoder and the encoder are
+ * stateless once the decoder is past a possible BOM, so from then on each
+ * input byte is simply looked up in a table of what it converts to. The
+ * table is built on first use for each pair of encodings and shared by
+ * all threads afterwards.
+ *
+ * The `Transcoder` refers to the decoder and the encoder without owning
+ * them. After reinitializing either with `new_decoder_into()` or
+ * `new_encoder_into()`, call `reset()`.
+ */
+class Transcoder final
+{
+public:
+  /**
+   * The size of the intermediate tile in bytes.
+   */
+  static constexpr size_t TILE_SIZE = 16 * 1024;
+
+  /**
+   * Pairs `decoder` and `encoder`, which must outlive the `Transcoder`.
+   * The intermediate tile is UTF-16 if `via_utf16` is `true` and UTF-8
+   * otherwise.
+   */
+  Transcoder(Decoder& decoder, Encoder& encoder, bool via_utf16 = false)
+    : decoder_(&decoder)
+    , encoder_(&encoder)
+    , via_utf16_(via_utf16)
+    , decoded_(0)
+    , table_from_(nullptr)
+    , table_to_(nullptr)
+    , table_(nullptr)
+    , pending_start_(0)
+    , pending_end_(0)
+    , pending_(false)
+    , finishing_(false)
+  {
+    if (via_utf16) {
+      utf16_tile_.resize(TILE_SIZE / sizeof(char16_t));
+    } else {
+      utf8_tile_.resize(TILE_SIZE);
+    }
+  }
+
+  /**
+   * Forgets the state of the stream so far. Call after reinitializing the
+   * decoder or the encoder. The byte table found for the stream stays
+   * cached for as long as the pair of encodings stays the same, so that
+   * many short streams don't each look it up again.
+   */
+  inline void reset()
+  {
+    decoded_ = 0;
+    pending_start_ = 0;
+    pending_end_ = 0;
+    pending_ = false;
+    finishing_ = false;
+  }
+
+  /**
+   * Incrementally convert bytes in the encoding of the decoder to bytes in
+   * the encoding of the encoder with malformed sequences replaced with the
+   * REPLACEMENT CHARACTER and unmappable characters replaced with HTML
+   * (decimal) numeric character references.
+   *
+   * Returns the result (`INPUT_EMPTY` or `OUTPUT_FULL`), the number of
+   * bytes read from `src`, the number of bytes written to `dst` and whether
+   * there were replacements. `src` and `dst` work as with `decode_*` and
+   * `encode_*`, including `last`, except that the bytes read may not have
+   * made it to `dst` yet when the result is `OUTPUT_FULL`. `INPUT_EMPTY`
+   * means that all input read so far has been written.
+   */
+  inline std::tuple<uint32_t, size_t, size_t, bool> transcode(
+    gsl::span<const uint8_t> src,
+    gsl::span<uint8_t> dst,
+    bool last)
+  {
+    size_t read = 0;
+    size_t written = 0;
+    bool had_replacements = false;
+    for (;;) {
+      if (pending_) {
+        uint32_t result;
+        size_t tile_read;
+        size_t tile_written;
+        bool replaced;
+        if (via_utf16_) {
+          std::u16string_view pending(utf16_tile_.data() + pending_start_,
+                                      pending_end_ - pending_start_);
+          std::tie(result, tile_read, tile_written, replaced) =
+            encoder_->encode_from_utf16(
+              pending, dst.subspan(written), finishing_);
+        } else {
+          std::string_view pending(
+            reinterpret_cast<const char*>(utf8_tile_.data()) + pending_start_,
+            pending_end_ - pending_start_);
+          std::tie(result, tile_read, tile_written, replaced) =
+            encoder_->encode_from_utf8(
+              pending, dst.subspan(written), finishing_);
+        }
+        pending_start_ += tile_read;
+        written += tile_written;
+        had_replacements |= replaced;
+        if (result == OUTPUT_FULL) {
+          return { OUTPUT_FULL, read, written, had_replacements };
+        }
+        pending_ = false;
+        if (finishing_) {
+          finishing_ = false;
+          return { INPUT_EMPTY, read, written, had_replacements };
+        }
+      }
+      if (read == src.size() && !last) {
+        return { INPUT_EMPTY, read, written, had_replacements };
+      }
+      if (const ByteTable* table = byte_table()) {
+        auto [table_read, table_written, replaced] =
+          table->convert(src.subspan(read), dst.subspan(written));
+        read += table_read;
+        written += table_written;
+        had_replacements |= replaced;
+        if (read < src.size()) {
+          return { OUTPUT_FULL, read, written, had_replacements };
+        }
+        return { INPUT_EMPTY, read, written, had_replacements };
+      }
+      uint32_t result;
+      size_t decoder_read;
+      size_t decoder_written;
+      bool replaced;
+      if (via_utf16_) {
+        std::tie(result, decoder_read, decoder_written, replaced) =
+          decoder_->decode_to_utf16(
+            src.subspan(read), gsl::make_span(utf16_tile_), last);
+      } else if (encoder_->encoding() == UTF_8_ENCODING) {
+        std::tie(result, decoder_read, decoder_written, replaced) =
+          decoder_->decode_to_utf8(
+            src.subspan(read), dst.subspan(written), last);
+        read += decoder_read;
+        written += decoder_written;
+        decoded_ += decoder_read;
+        had_replacements |= replaced;
+        return { result, read, written, had_replacements };
+      } else {
+        std::tie(result, decoder_read, decoder_written, replaced) =
+          decoder_->decode_to_utf8(
+            src.subspan(read), gsl::make_span(utf8_tile_), last);
+      }
+      read += decoder_read;
+      decoded_ += decoder_read;
+      had_replacements |= replaced;
+      pending_start_ = 0;
+      pending_end_ = decoder_written;
+      // The encoder gets to flush its state (e.g. to switch ISO-2022-JP
+      // back to ASCII) even if the decoder had nothing more to output.
+      finishing_ = last && result == INPUT_EMPTY;
+      pending_ = decoder_written || finishing_;
+    }
+  }
+
+  /**
+   * What each byte converts to when going from one single-byte encoding to
+   * another.
+   */
+  struct ByteTable
+  {
+    /**
+     * Long enough for the numeric character reference of any character
+     * that a single-byte decoder outputs.
+     */
+    static constexpr size_t MAX_SEQUENCE_LENGTH = 16;
+
+    /**
+     * Whether the byte converts to a single byte without replacements.
+     */
+    std::array<bool, 256> direct;
+
+    /**
+     * The byte that a byte in `direct` converts to.
+     */
+    std::array<uint8_t, 256> bytes;
+
+    /**
+     * What a byte not in `direct` converts to.
+     */
+    std::array<std::array<uint8_t, MAX_SEQUENCE_LENGTH>, 256> sequences;
+    std::array<uint8_t, 256> lengths;
+    std::array<bool, 256> replaced;
+
+    /**
+     * Whether the byte is unmapped in the input encoding, so that the
+     * decoder replaced it.
+     */
+    std::array<bool, 256> malformed;
+
+    ByteTable(const Encoding* from, const Encoding* to)
+    {
+      PooledDecoder decoder = from->pooled_decoder_without_bom_handling();
+      PooledEncoder encoder = to->pooled_encoder();
+      for (size_t i = 0; i < 256; i++) {
+        uint8_t byte = static_cast<uint8_t>(i);
+        std::array<char16_t, 8> utf16;
+        size_t utf16_written;
+        bool decoder_replaced;
+        std::tie(std::ignore, std::ignore, utf16_written, decoder_replaced) =
+          decoder->decode_to_utf16(gsl::make_span(&byte, 1), utf16, false);
+        size_t sequence_written;
+        bool encoder_replaced;
+        std::tie(std::ignore, std::ignore, sequence_written, encoder_replaced) =
+          encoder->encode_from_utf16(
+            std::u16string_view(utf16.data(), utf16_written),
+            sequences[i],
+            false);
+        lengths[i] = static_cast<uint8_t>(sequence_written);
+        malformed[i] = decoder_replaced;
+        replaced[i] = decoder_replaced || encoder_replaced;
+        direct[i] = sequence_written == 1 && !replaced[i];
+        bytes[i] = direct[i] ? sequences[i][0] : 0;
+      }
+    }
+
+    /**
+     * Converts as much of `src` as fits in `dst` and returns the number of
+     * bytes read and written and whether there were replacements.
+     */
+    inline std::tuple<size_t, size_t, bool> convert(
+      gsl::span<const uint8_t> src,
+      gsl::span<uint8_t> dst) const
+    {
+      size_t read = 0;
+      size_t written = 0;
+      bool had_replacements = false;
+      for (;;) {
+        size_t run = std::min(src.size() - read, dst.size() - written);
+        const uint8_t* in = src.data() + read;
+        uint8_t* out = dst.data() + written;
+        size_t i = 0;
+        while (i < run && direct[in[i]]) {
+          out[i] = bytes[in[i]];
+          i++;
+        }
+        read += i;
+        written += i;
+        if (read == src.size()) {
+          break;
+        }
+        uint8_t byte = src[read];
+        if (direct[byte] || lengths[byte] > dst.size() - written) {
+          // Out of output space.
+          break;
+        }
+        memcpy(dst.data() + written, sequences[byte].data(), lengths[byte]);
+        read++;
+        written += lengths[byte];
+        had_replacements |= replaced[byte];
+      }
+      return { read, written, had_replacements };
+    }
+  };
+
+  /**
+   * The table for converting from the single-byte encoding `from` to the
+   * single-byte encoding `to`, built on the first call for the pair.
+   */
+  static inline const ByteTable& shared_byte_table(const Encoding* from,
+                                                   const Encoding* to)
+  {
+    static std::mutex mutex;
+    static std::map<std::pair<const Encoding*, const Encoding*>,
+                    std::unique_ptr<ByteTable>>
+      tables;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<ByteTable>& table = tables[{ from, to }];
+    if (!table) {
+      table = std::make_unique<ByteTable>(from, to);
+    }
+    return *table;
+  }
+
+private:
+  /**
+   * The table for the current pair of encodings if both are single-byte
+   * and the decoder is past a possible BOM, or `nullptr`.
+   */
+  inline const ByteTable* byte_table()
+  {
+    // A BOM-sniffing decoder has made up its mind after three bytes.
+    if (decoded_ < 3) {
+      return nullptr;
+    }
+    const Encoding* from = decoder_->encoding();
+    const Encoding* to = encoder_->encoding();
+    if (from != table_from_ || to != table_to_) {
+      table_from_ = from;
+      table_to_ = to;
+      table_ = from->is_single_byte() && to->is_single_byte()
+                 ? &shared_byte_table(from, to)
+                 : nullptr;
+    }
+    return table_;
+  }
+
+  Decoder* decoder_;
+  Encoder* encoder_;
+  bool via_utf16_;
+  std::vector<uint8_t> utf8_tile_;
+  std::vector<char16_t> utf16_tile_;
+  // Bytes fed to the decoder since the start of the stream.
+  uint64_t decoded_;
+  // The pair of encodings that `table_` was looked up for.
+  const Encoding* table_from_;
+  const Encoding* table_to_;
+  const ByteTable* table_;
+  // The part of the tile that the encoder hasn't consumed yet.
+  size_t pending_start_;
+  size_t pending_end_;
+  bool pending_;
+  // Whether the pending part is the end of the stream.
+  bool finishing_;
+};
+
 }; // namespace encoding_rs
 
 #endif // encoding_rs_cpp_h_
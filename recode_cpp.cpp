@@ -7,12 +7,50 @@
 // option. This file may not be copied, modified, or distributed
 // except according to those terms.
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <functional>
 #include <iterator>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <math.h>
+#include <mutex>
+#include <optional>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+// The single-byte kernels are compiled for each instruction set with
+// target attributes and picked at run time.
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
 
 #include "encoding_rs_cpp.h"
 
@@ -30,6 +68,43 @@ get_encoding(const char* label)
   return enc;
 }
 
+unsigned
+get_count(const char* arg)
+{
+  char* end;
+  unsigned long count = strtoul(arg, &end, 10);
+  if (*end || !count || count > 1024) {
+    fprintf(stderr, "%s is not a valid count; exiting.", arg);
+    exit(-2);
+  }
+  return static_cast<unsigned>(count);
+}
+
+uint64_t
+get_limit(const char* arg)
+{
+  char* end;
+  unsigned long long limit = strtoull(arg, &end, 10);
+  if (*end || !*arg || *arg == '-') {
+    fprintf(stderr, "%s is not a valid count; exiting.", arg);
+    exit(-2);
+  }
+  return limit;
+}
+
+// The --line-buffered deadline in milliseconds, at most an hour.
+std::chrono::milliseconds
+get_deadline(const char* arg)
+{
+  char* end;
+  unsigned long ms = strtoul(arg, &end, 10);
+  if (*end || !*arg || *arg == '-' || ms > 3600 * 1000) {
+    fprintf(stderr, "%s is not a valid deadline; exiting.", arg);
+    exit(-2);
+  }
+  return std::chrono::milliseconds(ms);
+}
+
 void
 print_usage(const char* program)
 {
@@ -40,199 +115,4904 @@ print_usage(const char* program)
     "    -o, --output PATH\n"
     "                        set output file name (- for stdout; the default)\n"
     "    -f, --from-code LABEL\n"
-    "                        set input encoding (defaults to UTF-8)\n"
+    "                        set input encoding (defaults to UTF-8; auto\n"
+    "                        detects it from the first 64 KB of the input,\n"
+    "                        of each file with --batch or of what the first\n"
+    "                        read from stdin returns with --line-buffered)\n"
     "    -t, --to-code LABEL\n"
     "                        set output encoding (defaults to UTF-8)\n"
     "    -u, --utf16-intermediate\n"
     "                        use UTF-16 instead of UTF-8 as the intermediate\n"
     "                        encoding\n"
+    "    -N, --no-mmap       read input files with fread instead of mapping\n"
+    "                        them into memory (same as --io stdio)\n"
+    "    -I, --io BACKEND    read input files by mapping them into memory\n"
+    "                        (mmap; the default), with fread (stdio) or\n"
+    "                        through io_uring with several reads and -o and\n"
+    "                        --batch writes in flight (uring; falls back to\n"
+    "                        stdio where io_uring isn't available)\n"
+    "    -j, --jobs N        convert large input files on N threads unless\n"
+    "                        the input is UTF-16 or either encoding is\n"
+    "                        ISO-2022-JP (defaults to 1)\n"
+    "    -b, --buffer-size SIZE\n"
+    "                        convert SIZE bytes (K and M suffixes allowed) of\n"
+    "                        input per step or, with auto, grow the size\n"
+    "                        while it still pays off (defaults to 64K)\n"
+    "    -s, --stats[=FORMAT]\n"
+    "                        print call counts, byte counts and timings of\n"
+    "                        reading, decoding, encoding and writing to\n"
+    "                        stderr as text (the default) or json\n"
+    "    -B, --batch DIR     convert each INFILE (@FILE reads a list of paths\n"
+    "                        from FILE; no INFILE reads a NUL-separated list\n"
+    "                        from stdin) on its own into the same relative\n"
+    "                        path under DIR using --jobs threads\n"
+    "    -l, --line-buffered[=MS]\n"
+    "                        convert the input as soon as it arrives and\n"
+    "                        write the output at the end of each line or\n"
+    "                        once it has waited for MS milliseconds\n"
+    "                        (defaults to 10)\n"
+    "    -R, --records FORMAT\n"
+    "                        convert csv or tsv lines or nul-terminated\n"
+    "                        records each from its own encoding, in batches\n"
+    "                        on --jobs threads; records without a known\n"
+    "                        label are converted from the input encoding\n"
+    "    -F, --charset-field N\n"
+    "                        take the encoding of each record from its Nth\n"
+    "                        field (csv and tsv only)\n"
+    "    -C, --charsets PATH\n"
+    "                        take the encoding of each record from the\n"
+    "                        corresponding line of PATH\n"
+    "    -p, --pipeline      read, convert and write on separate threads;\n"
+    "                        --stats reports how long each of them waited\n"
+    "    -P, --preallocate   reserve disk space for the -o file up front,\n"
+    "                        sized for the worst case and trimmed at the end\n"
+    "    -c, --check         check that each INFILE is valid in the input\n"
+    "                        encoding instead of converting it, using --jobs\n"
+    "                        threads; print the offsets of malformed\n"
+    "                        sequences to stdout and exit with 1 if any\n"
+    "    -e, --max-errors N  stop checking an input after N malformed\n"
+    "                        sequences (defaults to 0, no limit)\n"
+    "    -S, --serve PATH    listen on the Unix domain socket PATH and\n"
+    "                        convert requests on --jobs threads until SIGINT\n"
+    "                        or SIGTERM; a request is a \"FROM TO LENGTH\\n\"\n"
+    "                        line and LENGTH (at most 16M) bytes, answered\n"
+    "                        with \"OK LENGTH\\n\" and the converted bytes or\n"
+    "                        \"ERR MESSAGE\\n\"; request latency percentiles\n"
+    "                        go to stderr on exit and on SIGUSR1\n"
+    "    -V, --version       print the vector instruction sets that the\n"
+    "                        single-byte kernels use (picked at run time)\n"
+    "                        and that encoding_rs was compiled for\n"
     "    -h, --help          print usage help\n",
     program);
 }
 
-#define INPUT_BUFFER_SIZE 2048
-#define UTF8_INTERMEDIATE_BUFFER_SIZE 4096
-#define UTF16_INTERMEDIATE_BUFFER_SIZE 2048
-#define OUTPUT_BUFFER_SIZE 4096
+// The vector instruction sets that the single-byte kernels use, from worst
+// to best.
+enum class SimdLevel
+{
+  Scalar,
+  Ssse3,
+  Avx2,
+  Avx512Vbmi,
+};
+
+// The best instruction set that the CPU supports, detected once.
+SimdLevel
+simd_level()
+{
+  static const SimdLevel level = [] {
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vbmi")) {
+      return SimdLevel::Avx512Vbmi;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return SimdLevel::Avx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+      return SimdLevel::Ssse3;
+    }
+#endif
+    return SimdLevel::Scalar;
+  }();
+  return level;
+}
+
+const char*
+simd_name(SimdLevel level)
+{
+  switch (level) {
+    case SimdLevel::Ssse3:
+      return "ssse3";
+    case SimdLevel::Avx2:
+      return "avx2";
+    case SimdLevel::Avx512Vbmi:
+      return "avx512vbmi";
+    default:
+      return "scalar";
+  }
+}
+
+// The highest x86 target feature that the Rust code, including
+// encoding_rs, was compiled for. Rust only selects its vector code at
+// compile time.
+extern "C" const char*
+rustglue_target_features();
+
+#define DETECTION_PREFIX_SIZE (64 * 1024)
+
+// Statistics of the bytes of a detection prefix, gathered in one pass that
+// skips ASCII 16 bytes at a time. The candidate single-byte encodings are
+// then scored from the statistics alone, without going over the prefix
+// again.
+struct ByteHistogram
+{
+  // Occurrences of each non-ASCII byte, of each non-ASCII byte right after
+  // an ASCII letter, right before one and at the start of a word, i.e.
+  // after other ASCII or at the start of the prefix.
+  std::array<uint32_t, 128> high{};
+  std::array<uint32_t, 128> after_letter{};
+  std::array<uint32_t, 128> before_letter{};
+  std::array<uint32_t, 128> word_start{};
+  // Occurrences of each pair of adjacent non-ASCII bytes, indexed by
+  // (first - 0x80) * 128 + second - 0x80, and the indices that are set.
+  std::vector<uint32_t> pairs;
+  std::vector<uint16_t> pair_list;
+  size_t non_ascii = 0;
+  // Zero bytes at even and odd offsets, which tell UTF-16 apart.
+  size_t zeros_even = 0;
+  size_t zeros_odd = 0;
+  size_t escapes = 0;
+};
+
+inline bool
+is_ascii_letter(uint8_t byte)
+{
+  return (byte | 0x20) >= 'a' && (byte | 0x20) <= 'z';
+}
+
+ByteHistogram
+byte_histogram(gsl::span<const uint8_t> prefix)
+{
+  ByteHistogram histogram;
+  histogram.pairs.resize(128 * 128);
+  const uint8_t* bytes = prefix.data();
+  size_t length = prefix.size();
+  auto count_high = [&](size_t i) {
+    uint8_t byte = bytes[i];
+    histogram.non_ascii++;
+    histogram.high[byte - 0x80]++;
+    if (!i) {
+      histogram.word_start[byte - 0x80]++;
+    } else if (is_ascii_letter(bytes[i - 1])) {
+      histogram.after_letter[byte - 0x80]++;
+    } else if (bytes[i - 1] < 0x80) {
+      histogram.word_start[byte - 0x80]++;
+    }
+    if (i + 1 < length) {
+      uint8_t next = bytes[i + 1];
+      if (is_ascii_letter(next)) {
+        histogram.before_letter[byte - 0x80]++;
+      } else if (next >= 0x80) {
+        size_t pair = (byte - 0x80) * 128 + (next - 0x80);
+        if (!histogram.pairs[pair]++) {
+          histogram.pair_list.push_back(static_cast<uint16_t>(pair));
+        }
+      }
+    }
+  };
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i escape = _mm_set1_epi8(0x1B);
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+    unsigned zeros =
+      static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)));
+    if (zeros) {
+      // `i` is even, so the even bits of the mask are the even offsets.
+      histogram.zeros_even += __builtin_popcount(zeros & 0x5555);
+      histogram.zeros_odd += __builtin_popcount(zeros & 0xAAAA);
+    }
+    histogram.escapes += __builtin_popcount(static_cast<unsigned>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, escape))));
+    unsigned high = static_cast<unsigned>(_mm_movemask_epi8(chunk));
+    while (high) {
+      count_high(i + __builtin_ctz(high));
+      high &= high - 1;
+    }
+  }
+#endif
+  for (; i < length; i++) {
+    uint8_t byte = bytes[i];
+    if (!byte) {
+      (i & 1 ? histogram.zeros_odd : histogram.zeros_even)++;
+    } else if (byte == 0x1B) {
+      histogram.escapes++;
+    } else if (byte >= 0x80) {
+      count_high(i);
+    }
+  }
+  return histogram;
+}
+
+// What a non-ASCII byte decodes to as far as scoring is concerned.
+enum class CharClass : uint8_t
+{
+  Unmapped,
+  Control,
+  Symbol,
+  LatinLower,
+  LatinUpper,
+  // A Latin letter that is rare in running text (eth, thorn, t with
+  // cedilla), which keeps windows-1252 and windows-1250 from matching
+  // Turkish text as well as windows-1254.
+  LatinRare,
+  // A letter of a cased non-Latin script (Greek, Cyrillic).
+  ScriptLower,
+  ScriptUpper,
+  // A letter of an uncased script (Hebrew, Arabic, Thai).
+  Script,
+  // A combining mark of an uncased script, which can't start a word.
+  Mark,
+};
+
+CharClass
+char_class(char16_t c)
+{
+  if (c == 0xFFFD) {
+    return CharClass::Unmapped;
+  }
+  if (c < 0xA0) {
+    return CharClass::Control;
+  }
+  if (c == 0xD0 || c == 0xDE || c == 0xF0 || c == 0xFE || c == 0x162 ||
+      c == 0x163) {
+    return CharClass::LatinRare;
+  }
+  if ((c >= 0xC0 && c <= 0xDE) || c == 0x178) {
+    return c == 0xD7 ? CharClass::Symbol : CharClass::LatinUpper;
+  }
+  if (c >= 0xDF && c <= 0xFF) {
+    return c == 0xF7 ? CharClass::Symbol : CharClass::LatinLower;
+  }
+  if (c >= 0x100 && c <= 0x24F && c != 0x192) {
+    // Latin Extended-A alternates between upper and lower case, with the
+    // phase flipping at U+0139 and U+0179.
+    bool even_lower = (c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E);
+    return ((c & 1) != even_lower) ? CharClass::LatinLower
+                                   : CharClass::LatinUpper;
+  }
+  if (c >= 0x300 && c <= 0x36F) {
+    // Combining marks follow Latin letters in windows-1258.
+    return CharClass::LatinLower;
+  }
+  if (c >= 0x386 && c <= 0x3CE) {
+    return c >= 0x3AC ? CharClass::ScriptLower : CharClass::ScriptUpper;
+  }
+  if (c >= 0x400 && c <= 0x4FF) {
+    if (c < 0x460) {
+      return c >= 0x430 ? CharClass::ScriptLower : CharClass::ScriptUpper;
+    }
+    return (c & 1) ? CharClass::ScriptLower : CharClass::ScriptUpper;
+  }
+  if ((c >= 0x5B0 && c <= 0x5C7) || (c >= 0x64B && c <= 0x652) ||
+      c == 0xE31 || (c >= 0xE34 && c <= 0xE3A) ||
+      (c >= 0xE47 && c <= 0xE4E)) {
+    return CharClass::Mark;
+  }
+  if ((c >= 0x5D0 && c <= 0x5EA) || (c >= 0x620 && c <= 0x6D3) ||
+      (c >= 0xE01 && c <= 0xE46)) {
+    return CharClass::Script;
+  }
+  return CharClass::Symbol;
+}
+
+// The single-byte encodings that detection considers, in the order of
+// preference when they score the same.
+const std::array<const Encoding*, 15>&
+single_byte_candidates()
+{
+  static const std::array<const Encoding*, 15> candidates = {
+    WINDOWS_1252_ENCODING, WINDOWS_1250_ENCODING, WINDOWS_1251_ENCODING,
+    KOI8_U_ENCODING,       IBM866_ENCODING,       WINDOWS_1253_ENCODING,
+    WINDOWS_1254_ENCODING, WINDOWS_1255_ENCODING, WINDOWS_1256_ENCODING,
+    WINDOWS_1257_ENCODING, WINDOWS_1258_ENCODING, WINDOWS_874_ENCODING,
+    ISO_8859_2_ENCODING,   ISO_8859_5_ENCODING,   X_MAC_CYRILLIC_ENCODING,
+  };
+  return candidates;
+}
+
+typedef std::array<CharClass, 128> ClassTable;
+
+// Returns the classes of the non-ASCII bytes in each of the single-byte
+// candidates, computed once by decoding the bytes.
+const std::vector<ClassTable>&
+single_byte_classes()
+{
+  static const std::vector<ClassTable> classes = [] {
+    std::vector<ClassTable> tables;
+    std::array<uint8_t, 128> bytes;
+    for (size_t i = 0; i < bytes.size(); i++) {
+      bytes[i] = static_cast<uint8_t>(0x80 + i);
+    }
+    for (const Encoding* encoding : single_byte_candidates()) {
+      auto decoder = encoding->new_decoder_without_bom_handling();
+      // The decoder wants room for the worst case even though each byte
+      // decodes to one code unit.
+      std::vector<char16_t> decoded(
+        decoder->max_utf16_buffer_length(bytes.size()).value());
+      decoder->decode_to_utf16(bytes, decoded, true);
+      ClassTable table;
+      for (size_t i = 0; i < table.size(); i++) {
+        table[i] = char_class(decoded[i]);
+      }
+      tables.push_back(table);
+    }
+    return tables;
+  }();
+  return classes;
+}
+
+inline bool
+is_cased_script(CharClass c)
+{
+  return c == CharClass::ScriptLower || c == CharClass::ScriptUpper;
+}
+
+inline bool
+is_latin(CharClass c)
+{
+  return c == CharClass::LatinLower || c == CharClass::LatinUpper ||
+         c == CharClass::LatinRare;
+}
+
+inline bool
+is_script(CharClass c)
+{
+  return is_cased_script(c) || c == CharClass::Script ||
+         c == CharClass::Mark;
+}
+
+// Scores how much the non-ASCII bytes look like text in a single-byte
+// encoding with the byte classes `table`. Letters score; control
+// characters, non-Latin letters glued to ASCII letters, combining marks
+// starting words, mixed scripts and case changes in the middle of words
+// are penalized, and so is a cased script without any capitals, which is
+// how text in an uncased script looks when decoded as one. Returns
+// `std::nullopt` if a byte is unmapped.
+std::optional<double>
+score_single_byte(const ByteHistogram& histogram, const ClassTable& table)
+{
+  double score = 0.0;
+  uint32_t script_lower = 0;
+  uint32_t script_upper = 0;
+  for (size_t b = 0; b < 128; b++) {
+    uint32_t count = histogram.high[b];
+    if (!count) {
+      continue;
+    }
+    CharClass c = table[b];
+    switch (c) {
+      case CharClass::Unmapped:
+        return std::nullopt;
+      case CharClass::Control:
+        score -= 10.0 * count;
+        break;
+      case CharClass::Symbol:
+        break;
+      case CharClass::LatinRare:
+        score += 0.2 * count;
+        break;
+      case CharClass::ScriptUpper:
+        script_upper += count;
+        [[fallthrough]];
+      case CharClass::LatinUpper:
+        score += 0.5 * count;
+        break;
+      case CharClass::ScriptLower:
+        script_lower += count;
+        score += count;
+        break;
+      default:
+        score += count;
+        break;
+    }
+    if (is_script(c)) {
+      score -= 3.0 * (histogram.after_letter[b] + histogram.before_letter[b]);
+    }
+    if (c == CharClass::Mark) {
+      score -= 3.0 * histogram.word_start[b];
+    }
+  }
+  for (uint16_t pair : histogram.pair_list) {
+    double count = histogram.pairs[pair];
+    CharClass first = table[pair / 128];
+    CharClass second = table[pair % 128];
+    if (is_latin(first) && is_latin(second)) {
+      score -= 0.5 * count;
+    } else if (is_script(first) && is_script(second)) {
+      bool lower_to_upper = first == CharClass::ScriptLower &&
+                            second == CharClass::ScriptUpper;
+      score += (lower_to_upper ? -2.0 : 1.0) * count;
+    } else if ((is_latin(first) && is_script(second)) ||
+               (is_script(first) && is_latin(second))) {
+      score -= 2.0 * count;
+    } else if ((first == CharClass::Symbol) != (second == CharClass::Symbol)) {
+      score -= 0.5 * count;
+    }
+  }
+  if (script_lower && !script_upper) {
+    score -= 0.5 * script_lower;
+  }
+  return score;
+}
+
+// Scores how much `prefix` looks like text in the multi-byte encoding
+// `encoding` from the ranges its lead and trail bytes fall in: common
+// characters score, rarely used rows and user-defined areas are
+// penalized, and so are characters that look like a non-ASCII letter in
+// the middle of an ASCII word. Returns `std::nullopt` if `prefix` isn't
+// well-formed in `encoding`.
+std::optional<double>
+score_multi_byte(const Encoding* encoding,
+                 gsl::span<const uint8_t> prefix,
+                 bool complete)
+{
+  double score = 0.0;
+  size_t i = 0;
+  while (i < prefix.size()) {
+    i += Encoding::ascii_valid_up_to(prefix.subspan(i));
+    if (i == prefix.size()) {
+      break;
+    }
+    uint8_t lead = prefix[i];
+    bool after_letter = i && is_ascii_letter(prefix[i - 1]);
+    if (i + 1 == prefix.size() &&
+        !(encoding == SHIFT_JIS_ENCODING && lead >= 0xA1 && lead <= 0xDF)) {
+      if (complete) {
+        return std::nullopt;
+      }
+      break;
+    }
+    uint8_t trail = i + 1 < prefix.size() ? prefix[i + 1] : 0;
+    size_t length = 2;
+    double value = 0.0;
+    if (encoding == SHIFT_JIS_ENCODING) {
+      if (lead >= 0xA1 && lead <= 0xDF) {
+        // Half-width katakana.
+        length = 1;
+        value = 0.2;
+      } else if (((lead >= 0x81 && lead <= 0x9F) || lead >= 0xE0) &&
+                 lead <= 0xFC && trail >= 0x40 && trail != 0x7F &&
+                 trail <= 0xFC) {
+        if (lead == 0x82 || lead == 0x83) {
+          value = 2.0;
+        } else if (lead == 0x81) {
+          value = 0.5;
+        } else if ((lead >= 0x88 && lead <= 0x9F) ||
+                   (lead >= 0xE0 && lead <= 0xEA)) {
+          value = 1.0;
+        } else if (lead >= 0xF0) {
+          value = -2.0;
+        }
+      } else {
+        return std::nullopt;
+      }
+    } else if (encoding == EUC_JP_ENCODING) {
+      if (lead == 0x8E && trail >= 0xA1 && trail <= 0xDF) {
+        value = 0.2;
+      } else if (lead == 0x8F && trail >= 0xA1 && trail <= 0xFE) {
+        // JIS X 0212. A missing third byte is only fine where the prefix
+        // was cut short.
+        length = 3;
+        value = -0.5;
+        if (i + 2 < prefix.size()
+              ? prefix[i + 2] < 0xA1 || prefix[i + 2] > 0xFE
+              : complete) {
+          return std::nullopt;
+        }
+      } else if (lead >= 0xA1 && lead <= 0xFE && trail >= 0xA1 &&
+                 trail <= 0xFE) {
+        if (lead == 0xA4 || lead == 0xA5) {
+          value = 2.0;
+        } else if (lead == 0xA1) {
+          value = 0.5;
+        } else if (lead >= 0xB0 && lead <= 0xF4) {
+          value = 1.0;
+        }
+      } else {
+        return std::nullopt;
+      }
+    } else if (encoding == EUC_KR_ENCODING) {
+      if (lead < 0x81 || lead > 0xFE ||
+          !(is_ascii_letter(trail) || (trail >= 0x81 && trail <= 0xFE))) {
+        return std::nullopt;
+      }
+      if (lead >= 0xB0 && lead <= 0xC8 && trail >= 0xA1) {
+        value = 2.0;
+      } else if (trail < 0xA1 && lead <= 0xC6) {
+        // Hangul outside KS X 1001.
+        value = 1.0;
+      } else if (lead == 0xA1) {
+        value = 0.5;
+      } else if (lead == 0xC9 || lead == 0xFE) {
+        value = -2.0;
+      } else if (lead >= 0xCA || lead == 0xAA || lead == 0xAB) {
+        // Hanja and kana are rare in Korean text.
+        value = -1.0;
+      }
+    } else if (encoding == GBK_ENCODING) {
+      if (lead < 0x81 || lead > 0xFE) {
+        return std::nullopt;
+      }
+      if (trail >= 0x30 && trail <= 0x39) {
+        // A four-byte gb18030 sequence.
+        length = 4;
+        value = -0.5;
+        if (i + 3 < prefix.size() &&
+            (prefix[i + 2] < 0x81 || prefix[i + 2] > 0xFE ||
+             prefix[i + 3] < 0x30 || prefix[i + 3] > 0x39)) {
+          return std::nullopt;
+        }
+      } else if (trail < 0x40 || trail == 0x7F || trail == 0xFF) {
+        return std::nullopt;
+      } else if (trail < 0xA1 || lead < 0xA1) {
+        value = -0.5;
+      } else if (lead >= 0xB0 && lead <= 0xD7) {
+        value = 1.5;
+      } else if (lead >= 0xD8 && lead <= 0xF7) {
+        value = 0.5;
+      } else if (lead <= 0xA3) {
+        value = 0.5;
+      } else if (lead == 0xA4 || lead == 0xA5) {
+        value = -1.0;
+      } else if ((lead >= 0xAA && lead <= 0xAF) || lead >= 0xF8) {
+        value = -2.0;
+      }
+    } else {
+      // Big5.
+      if (lead < 0x81 || lead > 0xFE ||
+          !((trail >= 0x40 && trail <= 0x7E) ||
+            (trail >= 0xA1 && trail <= 0xFE))) {
+        return std::nullopt;
+      }
+      if (lead >= 0xA4 && lead <= 0xC6) {
+        value = 1.5;
+      } else if (lead >= 0xC9 && lead <= 0xF9) {
+        value = 0.5;
+      } else if (lead >= 0xA1 && lead <= 0xA3) {
+        value = 0.5;
+      } else if (lead == 0xC7 || lead == 0xC8) {
+        value = -1.0;
+      } else {
+        value = -0.5;
+      }
+      if (trail <= 0x7E && value > 0.0) {
+        // Never seen in text from GB 2312.
+        value += 0.5;
+      }
+    }
+    if (length > 1 && after_letter && is_ascii_letter(trail)) {
+      value = -1.0;
+    }
+    // Per character rather than per byte, so double it to compare with
+    // single-byte scores.
+    score += 2.0 * value;
+    if (i + length > prefix.size() && complete) {
+      return std::nullopt;
+    }
+    i += length;
+  }
+  return score;
+}
+
+// Whether `tail`, where a valid UTF-8 prefix ends, is a sequence that the
+// end of the prefix cut short rather than a malformed one.
+bool
+truncated_utf8(gsl::span<const uint8_t> tail)
+{
+  uint8_t lead = tail[0];
+  size_t length = lead >= 0xF0 ? 4 : (lead >= 0xE0 ? 3 : 2);
+  if (lead < 0xC2 || lead > 0xF4 || tail.size() >= length) {
+    return false;
+  }
+  for (size_t i = 1; i < tail.size(); i++) {
+    if ((tail[i] & 0xC0) != 0x80) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Guesses the encoding of input that starts with `prefix`, which is all of
+// the input if `complete`. In order: a BOM, ISO-2022-JP escapes in 7-bit
+// input, UTF-16 from zero bytes, valid UTF-8 (including plain ASCII) and
+// otherwise the legacy encoding that scores best statistically, falling
+// back to windows-1252.
+const Encoding*
+detect_encoding(gsl::span<const uint8_t> prefix, bool complete)
+{
+  auto bom = Encoding::for_bom(prefix);
+  if (bom) {
+    return std::get<0>(*bom);
+  }
+  ByteHistogram histogram = byte_histogram(prefix);
+  if (histogram.escapes && !histogram.non_ascii) {
+    static const char* const escapes[] = { "\x1B$B", "\x1B$@", "\x1B(J" };
+    for (const char* escape : escapes) {
+      if (std::search(prefix.begin(), prefix.end(), escape, escape + 3) !=
+          prefix.end()) {
+        return ISO_2022_JP_ENCODING;
+      }
+    }
+  }
+  size_t units = prefix.size() / 2;
+  if (units >= 8) {
+    // ASCII-heavy UTF-16 has zero high bytes in most code units.
+    if (histogram.zeros_odd > units / 3 &&
+        histogram.zeros_even < histogram.zeros_odd / 8) {
+      return UTF_16LE_ENCODING;
+    }
+    if (histogram.zeros_even > units / 3 &&
+        histogram.zeros_odd < histogram.zeros_even / 8) {
+      return UTF_16BE_ENCODING;
+    }
+  }
+  size_t valid = Encoding::utf8_valid_up_to(prefix);
+  if (valid == prefix.size() ||
+      (!complete && truncated_utf8(prefix.subspan(valid)))) {
+    return UTF_8_ENCODING;
+  }
+
+  const Encoding* best = WINDOWS_1252_ENCODING;
+  double best_score = 0.0;
+  const auto& candidates = single_byte_candidates();
+  const auto& classes = single_byte_classes();
+  for (size_t i = 0; i < candidates.size(); i++) {
+    auto score = score_single_byte(histogram, classes[i]);
+    if (score && *score > best_score) {
+      best = candidates[i];
+      best_score = *score;
+    }
+  }
+  for (const Encoding* encoding : { SHIFT_JIS_ENCODING,
+                                    EUC_JP_ENCODING,
+                                    EUC_KR_ENCODING,
+                                    GBK_ENCODING,
+                                    BIG5_ENCODING }) {
+    auto score = score_multi_byte(encoding, prefix, complete);
+    if (score && *score > best_score) {
+      best = encoding;
+      best_score = *score;
+    }
+  }
+  return best;
+}
+
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+#define MIN_BUFFER_SIZE 16
+#define MAX_BUFFER_SIZE (1024 * 1024 * 1024)
+#define ADAPTIVE_MIN_BUFFER_SIZE (4 * 1024)
+#define ADAPTIVE_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+#define ADAPTIVE_SAMPLE_SIZE (8 * 1024 * 1024)
+
+// Wall time and time spent waiting on a queue for one pipeline stage.
+struct PipelineStage
+{
+  const char* name;
+  std::chrono::steady_clock::duration total;
+  std::chrono::steady_clock::duration stalled;
+};
+
+// Counters for --stats. Each thread updates an instance of its own and the
+// instances are merged once the threads are done, so nothing is shared on
+// the hot path. Code that records takes a `Stats*` that is null when
+// --stats wasn't given.
+struct Stats
+{
+  struct Stage
+  {
+    uint64_t calls = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    std::chrono::steady_clock::duration time{ 0 };
+
+    void record(std::chrono::steady_clock::time_point start,
+                size_t in,
+                size_t out)
+    {
+      calls++;
+      bytes_in += in;
+      bytes_out += out;
+      time += std::chrono::steady_clock::now() - start;
+    }
+
+    void merge(const Stage& other)
+    {
+      calls += other.calls;
+      bytes_in += other.bytes_in;
+      bytes_out += other.bytes_out;
+      time += other.time;
+    }
+  };
+
+  Stage read;
+  Stage decode;
+  Stage encode;
+  // Decoding and encoding fused in the transcoder, which can't tell the
+  // two apart.
+  Stage transcode;
+  Stage write;
+  uint64_t decoder_output_full = 0;
+  uint64_t encoder_output_full = 0;
+  uint64_t transcoder_output_full = 0;
+  // Decode calls that replaced malformed sequences.
+  uint64_t replacements = 0;
+  // Encode calls that hit unmappable characters.
+  uint64_t unmappables = 0;
+  // Transcode calls that did either.
+  uint64_t transcode_replacements = 0;
+  // What -f auto detected for the whole input, if it did.
+  const Encoding* detected = nullptr;
+  // The reader, transcoder and writer threads of --pipeline, if it was
+  // given, which tells whether the job is bound by input, by conversion or
+  // by output.
+  std::vector<PipelineStage> pipeline;
+
+  void record_decode(std::chrono::steady_clock::time_point start,
+                     size_t read_bytes,
+                     size_t written_bytes,
+                     uint32_t result,
+                     bool replaced)
+  {
+    decode.record(start, read_bytes, written_bytes);
+    decoder_output_full += (result == OUTPUT_FULL);
+    replacements += replaced;
+  }
+
+  void record_encode(std::chrono::steady_clock::time_point start,
+                     size_t read_bytes,
+                     size_t written_bytes,
+                     uint32_t result,
+                     bool unmappable)
+  {
+    encode.record(start, read_bytes, written_bytes);
+    encoder_output_full += (result == OUTPUT_FULL);
+    unmappables += unmappable;
+  }
+
+  void record_transcode(std::chrono::steady_clock::time_point start,
+                        size_t read_bytes,
+                        size_t written_bytes,
+                        uint32_t result,
+                        bool replaced)
+  {
+    transcode.record(start, read_bytes, written_bytes);
+    transcoder_output_full += (result == OUTPUT_FULL);
+    transcode_replacements += replaced;
+  }
+
+  void merge(const Stats& other)
+  {
+    read.merge(other.read);
+    decode.merge(other.decode);
+    encode.merge(other.encode);
+    transcode.merge(other.transcode);
+    write.merge(other.write);
+    decoder_output_full += other.decoder_output_full;
+    encoder_output_full += other.encoder_output_full;
+    transcoder_output_full += other.transcoder_output_full;
+    replacements += other.replacements;
+    unmappables += other.unmappables;
+    transcode_replacements += other.transcode_replacements;
+  }
+
+  void print(FILE* out, bool json, std::chrono::steady_clock::duration wall)
+  {
+    const std::pair<const char*, const Stage&> stages[] = {
+      { "read", read },
+      { "decode", decode },
+      { "encode", encode },
+      { "transcode", transcode },
+      { "write", write },
+    };
+    typedef std::chrono::duration<double> seconds;
+    if (json) {
+      fprintf(out, "{");
+      if (detected) {
+        // Encoding names are plain ASCII without quotes or backslashes.
+        fprintf(out,
+                "\"detected_input_encoding\": \"%s\", ",
+                detected->name().c_str());
+      }
+      for (const auto& [name, stage] : stages) {
+        fprintf(out,
+                "\"%s\": { \"calls\": %" PRIu64 ", \"bytes_in\": %" PRIu64
+                ", \"bytes_out\": %" PRIu64 ", \"seconds\": %.6f }, ",
+                name,
+                stage.calls,
+                stage.bytes_in,
+                stage.bytes_out,
+                std::chrono::duration_cast<seconds>(stage.time).count());
+      }
+      fprintf(out,
+              "\"decoder_output_full\": %" PRIu64
+              ", \"encoder_output_full\": %" PRIu64
+              ", \"transcoder_output_full\": %" PRIu64
+              ", \"replacements\": %" PRIu64 ", \"unmappables\": %" PRIu64
+              ", \"transcode_replacements\": %" PRIu64
+              ", \"single_byte_kernel\": \"%s\""
+              ", \"rust_target_features\": \"%s\"",
+              decoder_output_full,
+              encoder_output_full,
+              transcoder_output_full,
+              replacements,
+              unmappables,
+              transcode_replacements,
+              simd_name(simd_level()),
+              rustglue_target_features());
+      if (!pipeline.empty()) {
+        fprintf(out, ", \"pipeline\": {");
+        for (size_t i = 0; i < pipeline.size(); i++) {
+          fprintf(out,
+                  "%s \"%s\": { \"busy_seconds\": %.6f"
+                  ", \"stalled_seconds\": %.6f }",
+                  i ? "," : "",
+                  pipeline[i].name,
+                  std::chrono::duration_cast<seconds>(pipeline[i].total -
+                                                      pipeline[i].stalled)
+                    .count(),
+                  std::chrono::duration_cast<seconds>(pipeline[i].stalled)
+                    .count());
+        }
+        fprintf(out, " }");
+      }
+      fprintf(out,
+              ", \"wall_seconds\": %.6f }\n",
+              std::chrono::duration_cast<seconds>(wall).count());
+      return;
+    }
+    if (detected) {
+      fprintf(out, "detected input encoding: %s\n", detected->name().c_str());
+    }
+    fprintf(out,
+            "stage        calls       bytes in      bytes out    seconds\n");
+    for (const auto& [name, stage] : stages) {
+      fprintf(out,
+              "%-9s %8" PRIu64 " %14" PRIu64 " %14" PRIu64 " %10.3f\n",
+              name,
+              stage.calls,
+              stage.bytes_in,
+              stage.bytes_out,
+              std::chrono::duration_cast<seconds>(stage.time).count());
+    }
+    fprintf(out,
+            "decoder OUTPUT_FULL round-trips:    %" PRIu64 "\n"
+            "encoder OUTPUT_FULL round-trips:    %" PRIu64 "\n"
+            "transcoder OUTPUT_FULL round-trips: %" PRIu64 "\n"
+            "decode calls with replacements:     %" PRIu64 "\n"
+            "encode calls with unmappables:      %" PRIu64 "\n"
+            "transcode calls with replacements:  %" PRIu64 "\n"
+            "single-byte kernel:                 %s\n"
+            "Rust target features:               %s\n",
+            decoder_output_full,
+            encoder_output_full,
+            transcoder_output_full,
+            replacements,
+            unmappables,
+            transcode_replacements,
+            simd_name(simd_level()),
+            rustglue_target_features());
+    for (const PipelineStage& stage : pipeline) {
+      double total = std::chrono::duration_cast<seconds>(stage.total).count();
+      double stalled =
+        std::chrono::duration_cast<seconds>(stage.stalled).count();
+      fprintf(out,
+              "pipeline %-11s %9.3f s busy %9.3f s stalled (%5.1f%%)\n",
+              stage.name,
+              total - stalled,
+              stalled,
+              total > 0.0 ? 100.0 * stalled / total : 0.0);
+    }
+    fprintf(out,
+            "wall time: %.3f s\n",
+            std::chrono::duration_cast<seconds>(wall).count());
+  }
+};
+
+// Returns the time to pass to `Stats::Stage::record()`, reading the clock
+// only if stats are being collected.
+inline std::chrono::steady_clock::time_point
+stats_start(const Stats* stats)
+{
+  return stats ? std::chrono::steady_clock::now()
+               : std::chrono::steady_clock::time_point();
+}
+
+size_t
+timed_fread(void* buffer, size_t size, FILE* read, Stats* stats)
+{
+  auto start = stats_start(stats);
+  size_t n = fread(buffer, 1, size, read);
+  if (stats) {
+    stats->read.record(start, n, n);
+  }
+  return n;
+}
+
+#define URING_ENTRIES 64
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_INPUT_BUFFERS 4
+#define URING_OUTPUT_BUFFERS 8
+
+// A minimal io_uring driven through the raw system calls so that there is
+// no liburing dependency. The ring owns URING_INPUT_BUFFERS input buffers
+// followed by URING_OUTPUT_BUFFERS output buffers of URING_BUFFER_SIZE
+// bytes each, registered with the kernel if it allows, which the reader
+// and the output recycle between them.
+//
+// Reads and writes at an offset that come back short are resubmitted for
+// the rest. A failed read exits with -5 and a failed write with -7 like
+// the stdio paths do.
+class IoRing final
+{
+public:
+  // Returns null if the kernel doesn't support io_uring or won't let this
+  // process use it.
+  static std::unique_ptr<IoRing> create()
+  {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd =
+      static_cast<int>(syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+    if (fd == -1) {
+      return nullptr;
+    }
+    std::unique_ptr<IoRing> ring(new IoRing(fd, params));
+    if (!ring->sq_ring_ || !ring->cq_ring_ || !ring->sqes_ ||
+        !ring->buffers_) {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  ~IoRing()
+  {
+    if (sq_ring_ && cq_ring_ && sqes_) {
+      while (writes_) {
+        wait_any();
+      }
+    }
+    if (buffers_) {
+      munmap(buffers_, BUFFER_COUNT * URING_BUFFER_SIZE);
+    }
+    if (sqes_) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+      munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+      munmap(sq_ring_, sq_ring_size_);
+    }
+    close(fd_);
+  }
+
+  uint8_t* buffer(int index)
+  {
+    return buffers_ + static_cast<size_t>(index) * URING_BUFFER_SIZE;
+  }
+
+  // Starts reading `length` bytes at `offset`, or at the file position if
+  // `offset` is -1, into input buffer `index`. Returns the operation to
+  // pass to `wait()`.
+  int read(int fd, int index, size_t length, off_t offset)
+  {
+    return start(fd, buffer(index), length, offset, index, false);
+  }
+
+  // Waits for the read `op` to complete and returns how many bytes it
+  // read, which is less than requested only at the end of the file.
+  size_t wait(int op)
+  {
+    while (!ops_[op].complete) {
+      wait_any();
+    }
+    size_t done = ops_[op].done;
+    free_ops_.push_back(op);
+    return done;
+  }
+
+  // Returns a free output buffer, waiting for a write to complete if need
+  // be, or -1 if all of them are held by the caller.
+  int acquire_output()
+  {
+    while (free_outputs_.empty()) {
+      if (!writes_) {
+        return -1;
+      }
+      wait_any();
+    }
+    int index = free_outputs_.back();
+    free_outputs_.pop_back();
+    return index;
+  }
+
+  void release_output(int index) { free_outputs_.push_back(index); }
+
+  // Starts writing `length` bytes at `data` to `fd` at `offset` and takes
+  // over the memory: output buffer `index` goes back to the free list once
+  // written and memory from elsewhere (`index` -1) is unmapped.
+  void write(int fd,
+             uint8_t* data,
+             size_t length,
+             size_t capacity,
+             int index,
+             off_t offset)
+  {
+    int op = start(fd, data, length, offset, index, true);
+    ops_[op].capacity = capacity;
+    writes_++;
+    file(fd).writes++;
+  }
+
+  // Hands the bytes queued so far to the kernel without waiting.
+  void submit() { enter(0); }
+
+  // Waits until everything written to `fd` has been written.
+  void wait_for_writes(int fd)
+  {
+    while (file(fd).writes) {
+      wait_any();
+    }
+  }
+
+  // Closes `fd` once everything written to it has been written.
+  void close_after_writes(int fd)
+  {
+    if (!file(fd).writes) {
+      close_file(fd);
+      return;
+    }
+    file(fd).closing = true;
+    submit();
+  }
+
+private:
+  static const int BUFFER_COUNT = URING_INPUT_BUFFERS + URING_OUTPUT_BUFFERS;
+
+  struct Op
+  {
+    int fd;
+    uint8_t* data;
+    size_t length;
+    size_t done;
+    size_t capacity;
+    off_t offset;
+    int buffer;
+    bool write;
+    bool complete;
+    iovec iov;
+  };
+
+  // The writes in flight to one file.
+  struct File
+  {
+    int fd;
+    unsigned writes;
+    bool closing;
+  };
+
+  IoRing(int fd, const io_uring_params& params)
+    : fd_(fd)
+    , sq_ring_(nullptr)
+    , cq_ring_(nullptr)
+    , sqes_(nullptr)
+    , buffers_(nullptr)
+    , registered_(false)
+    , unsubmitted_(0)
+    , writes_(0)
+    , ops_(params.sq_entries)
+  {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = reinterpret_cast<io_uring_sqe*>(map(sqes_size_, IORING_OFF_SQES));
+    if (!sq_ring_ || !cq_ring_ || !sqes_) {
+      return;
+    }
+    sq_tail_ = field(sq_ring_, params.sq_off.tail);
+    sq_mask_ = *field(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = field(sq_ring_, params.sq_off.array);
+    cq_head_ = field(cq_ring_, params.cq_off.head);
+    cq_tail_ = field(cq_ring_, params.cq_off.tail);
+    cq_mask_ = *field(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + params.cq_off.cqes);
+
+    void* buffers = mmap(nullptr,
+                         BUFFER_COUNT * URING_BUFFER_SIZE,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1,
+                         0);
+    if (buffers == MAP_FAILED) {
+      return;
+    }
+    buffers_ = static_cast<uint8_t*>(buffers);
+    std::array<iovec, BUFFER_COUNT> iovs;
+    for (int i = 0; i < BUFFER_COUNT; i++) {
+      iovs[i] = { buffer(i), URING_BUFFER_SIZE };
+    }
+    // Registering pins the buffers, which RLIMIT_MEMLOCK may not allow.
+    // The plain vectored operations work without it.
+    registered_ = !syscall(__NR_io_uring_register,
+                           fd_,
+                           IORING_REGISTER_BUFFERS,
+                           iovs.data(),
+                           BUFFER_COUNT);
+    for (int i = BUFFER_COUNT - 1; i >= URING_INPUT_BUFFERS; i--) {
+      free_outputs_.push_back(i);
+    }
+    for (int i = static_cast<int>(ops_.size()) - 1; i >= 0; i--) {
+      free_ops_.push_back(i);
+    }
+  }
+
+  uint8_t* map(size_t size, off_t offset)
+  {
+    void* map = mmap(nullptr,
+                     size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     fd_,
+                     offset);
+    return map == MAP_FAILED ? nullptr : static_cast<uint8_t*>(map);
+  }
+
+  static unsigned* field(uint8_t* ring, uint32_t offset)
+  {
+    return reinterpret_cast<unsigned*>(ring + offset);
+  }
+
+  File& file(int fd)
+  {
+    for (File& file : files_) {
+      if (file.fd == fd) {
+        return file;
+      }
+    }
+    files_.push_back({ fd, 0, false });
+    return files_.back();
+  }
+
+  void close_file(int fd)
+  {
+    for (size_t i = 0; i < files_.size(); i++) {
+      if (files_[i].fd == fd) {
+        files_.erase(files_.begin() + i);
+        break;
+      }
+    }
+    if (close(fd)) {
+      fprintf(stderr, "Error writing output.");
+      exit(-7);
+    }
+  }
+
+  int start(int fd,
+            uint8_t* data,
+            size_t length,
+            off_t offset,
+            int buffer,
+            bool write)
+  {
+    while (free_ops_.empty()) {
+      wait_any();
+    }
+    int op = free_ops_.back();
+    free_ops_.pop_back();
+    ops_[op] = { fd, data, length, 0, 0, offset, buffer, write, false, {} };
+    queue(op);
+    return op;
+  }
+
+  // Puts the rest of `op` in the submission queue.
+  void queue(int op)
+  {
+    Op& o = ops_[op];
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & sq_mask_;
+    io_uring_sqe& sqe = sqes_[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = o.fd;
+    sqe.off = o.offset == -1 ? static_cast<uint64_t>(-1)
+                             : static_cast<uint64_t>(o.offset + o.done);
+    sqe.user_data = static_cast<uint64_t>(op);
+    if (registered_ && o.buffer != -1) {
+      sqe.opcode = o.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe.addr = reinterpret_cast<uint64_t>(o.data + o.done);
+      sqe.len = static_cast<uint32_t>(o.length - o.done);
+      sqe.buf_index = static_cast<uint16_t>(o.buffer);
+    } else {
+      o.iov = { o.data + o.done, o.length - o.done };
+      sqe.opcode = o.write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe.addr = reinterpret_cast<uint64_t>(&o.iov);
+      sqe.len = 1;
+    }
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted_++;
+  }
+
+  // Submits what is queued and, if `min_complete`, waits for that many
+  // completions.
+  void enter(unsigned min_complete)
+  {
+    while (unsubmitted_ || min_complete) {
+      long n = syscall(__NR_io_uring_enter,
+                       fd_,
+                       unsubmitted_,
+                       min_complete,
+                       min_complete ? IORING_ENTER_GETEVENTS : 0,
+                       nullptr,
+                       0);
+      if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+          // The completion queue needs draining or a signal came in.
+          if (reap()) {
+            min_complete = 0;
+          }
+          continue;
+        }
+        fprintf(stderr, "Error waiting for I/O.");
+        exit(-5);
+      }
+      unsubmitted_ -= static_cast<unsigned>(n);
+      min_complete = 0;
+    }
+  }
+
+  void wait_any()
+  {
+    if (!reap()) {
+      enter(1);
+      reap();
+    }
+  }
+
+  // Processes the completions that have arrived. Returns how many.
+  unsigned reap()
+  {
+    unsigned reaped = 0;
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      int op = static_cast<int>(cqe.user_data);
+      int res = cqe.res;
+      head++;
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+      completed(op, res);
+      reaped++;
+    }
+    return reaped;
+  }
+
+  void completed(int op, int res)
+  {
+    Op& o = ops_[op];
+    if (res < 0 || (o.write && !res)) {
+      fprintf(stderr,
+              o.write ? "Error writing output." : "Error reading input.");
+      exit(o.write ? -7 : -5);
+    }
+    o.done += static_cast<size_t>(res);
+    if (res && o.done < o.length && o.offset != -1) {
+      queue(op);
+      return;
+    }
+    if (!o.write) {
+      o.complete = true;
+      return;
+    }
+    if (o.buffer != -1) {
+      free_outputs_.push_back(o.buffer);
+    } else {
+      munmap(o.data, o.capacity);
+    }
+    free_ops_.push_back(op);
+    writes_--;
+    File& f = file(o.fd);
+    if (!--f.writes && f.closing) {
+      close_file(o.fd);
+    }
+  }
+
+  int fd_;
+  uint8_t* sq_ring_;
+  uint8_t* cq_ring_;
+  io_uring_sqe* sqes_;
+  size_t sq_ring_size_;
+  size_t cq_ring_size_;
+  size_t sqes_size_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+  uint8_t* buffers_;
+  bool registered_;
+  unsigned unsubmitted_;
+  unsigned writes_;
+  std::vector<Op> ops_;
+  std::vector<int> free_ops_;
+  std::vector<int> free_outputs_;
+  std::vector<File> files_;
+};
+
+#define OUTPUT_REGION_SIZE (256 * 1024)
+#define OUTPUT_FLUSH_SIZE (1024 * 1024)
+#define OUTPUT_SPARE_REGIONS 8
+
+// Where converted bytes go. The converters encode straight into regions of
+// page-aligned memory handed out by `reserve()`, and the filled regions are
+// submitted to the kernel together once at least OUTPUT_FLUSH_SIZE bytes
+// have accumulated:
+//
+// * with vmsplice() if the destination is a pipe, gifting the pages to the
+//   kernel instead of having it copy them,
+// * with pwritev() at the output's own offset if the destination is a file
+//   that recode_cpp opened itself (-o and batch mode),
+// * through an `IoRing`, if given one, instead of pwritev(), so that
+//   several writes are in flight while conversion continues,
+// * with writev() otherwise.
+//
+// An output without a file descriptor keeps its regions in memory until
+// another output takes them over with `take()`.
+class Output final
+{
+public:
+  // An output that stays in memory.
+  Output()
+    : ring_(nullptr)
+    , fd_(-1)
+    , mode_(Mode::Memory)
+    , offset_(0)
+    , pending_(0)
+    , kernel_copy_(false)
+    , preallocated_(false)
+  {
+  }
+
+  Output(int fd, bool positional, IoRing* ring = nullptr)
+    : Output()
+  {
+    ring_ = ring;
+    open(fd, positional);
+  }
+
+  // Makes positional outputs opened from now on write through `ring`.
+  void use_ring(IoRing* ring) { ring_ = ring; }
+
+  // Writes to a pipe with writev() instead of vmsplice(). Gifting pages only
+  // pays off for full regions, not for output flushed a line at a time.
+  void avoid_splice()
+  {
+    if (mode_ == Mode::Splice) {
+      mode_ = Mode::Write;
+    }
+  }
+
+  Output(const Output&) = delete;
+  Output& operator=(const Output&) = delete;
+
+  ~Output()
+  {
+    for (Region& region : regions_) {
+      release(region);
+    }
+    for (Region& region : spare_) {
+      release(region);
+    }
+  }
+
+  // Points the output at `fd`, which must be a file recode_cpp opened itself
+  // if `positional`. Any pending bytes must have been flushed.
+  void open(int fd, bool positional)
+  {
+    struct stat st;
+    bool stat_ok = !fstat(fd, &st);
+    fd_ = fd;
+    offset_ = 0;
+    preallocated_ = false;
+    kernel_copy_ = true;
+    if (stat_ok && S_ISFIFO(st.st_mode)) {
+      mode_ = Mode::Splice;
+    } else if (positional && stat_ok && S_ISREG(st.st_mode)) {
+      mode_ = ring_ ? Mode::Ring : Mode::Positional;
+    } else {
+      mode_ = Mode::Write;
+    }
+  }
+
+  // Returns space for at least `min` bytes, which `commit()` then claims.
+  gsl::span<uint8_t> reserve(size_t min)
+  {
+    if (regions_.empty() ||
+        regions_.back().capacity - regions_.back().length < min) {
+      regions_.push_back(take_spare(min));
+    }
+    Region& region = regions_.back();
+    return gsl::span<uint8_t>(region.data + region.length,
+                              region.capacity - region.length);
+  }
+
+  void commit(size_t length)
+  {
+    regions_.back().length += length;
+    pending_ += length;
+    if (mode_ != Mode::Memory && pending_ >= OUTPUT_FLUSH_SIZE) {
+      flush();
+    }
+  }
+
+  void write(gsl::span<const uint8_t> bytes)
+  {
+    while (!bytes.empty()) {
+      gsl::span<uint8_t> space = reserve(1);
+      size_t length = std::min(bytes.size(), space.size());
+      memcpy(space.data(), bytes.data(), length);
+      commit(length);
+      bytes = bytes.subspan(length);
+    }
+  }
+
+  size_t pending() const { return pending_; }
+
+  // Appends the bytes held by `from`, which is left empty, without copying
+  // them, and hands spare regions back to `from` for reuse.
+  void take(Output& from)
+  {
+    for (Region& region : from.regions_) {
+      if (region.length) {
+        regions_.push_back(region);
+      } else {
+        from.spare_.push_back(region);
+      }
+    }
+    pending_ += from.pending_;
+    from.regions_.clear();
+    from.pending_ = 0;
+    while (!spare_.empty() && from.spare_.size() < OUTPUT_SPARE_REGIONS) {
+      from.spare_.push_back(spare_.back());
+      spare_.pop_back();
+    }
+    if (mode_ != Mode::Memory && pending_ >= OUTPUT_FLUSH_SIZE) {
+      flush();
+    }
+  }
+
+  // Submits the pending bytes.
+  void flush()
+  {
+    if (mode_ == Mode::Memory || regions_.empty()) {
+      return;
+    }
+    auto start = stats_start(stats);
+    if (mode_ == Mode::Ring) {
+      for (Region& region : regions_) {
+        if (!region.length) {
+          release(region);
+          continue;
+        }
+        // The ring owns the region until the write completes.
+        ring_->write(fd_,
+                     region.data,
+                     region.length,
+                     region.capacity,
+                     region.buffer,
+                     offset_);
+        offset_ += region.length;
+      }
+      ring_->submit();
+      if (stats) {
+        stats->write.record(start, pending_, pending_);
+      }
+      regions_.clear();
+      pending_ = 0;
+      return;
+    }
+    std::vector<iovec> iov;
+    for (const Region& region : regions_) {
+      if (region.length) {
+        iov.push_back({ region.data, region.length });
+      }
+    }
+    size_t calls = submit(iov);
+    if (stats) {
+      stats->write.record(start, pending_, pending_);
+      stats->write.calls += calls - 1;
+    }
+    recycle();
+  }
+
+  // Sends the bytes held by an output that stays in memory to the socket
+  // `fd`, leaving the output empty. Unlike the other ways out, a peer that
+  // has gone away isn't fatal: returns false if the bytes couldn't all be
+  // sent.
+  bool send(int fd)
+  {
+    auto start = stats_start(stats);
+    std::vector<iovec> iov;
+    for (const Region& region : regions_) {
+      if (region.length) {
+        iov.push_back({ region.data, region.length });
+      }
+    }
+    size_t first = 0;
+    bool sent = true;
+    while (first < iov.size()) {
+      msghdr message{};
+      message.msg_iov = &iov[first];
+      message.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+      ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        sent = false;
+        break;
+      }
+      advance(iov, first, static_cast<size_t>(n));
+    }
+    if (stats) {
+      stats->write.record(start, pending_, pending_);
+    }
+    recycle();
+    return sent;
+  }
+
+  // Flushes and, if the file was preallocated, trims it to what was
+  // actually written.
+  void finish()
+  {
+    flush();
+    if (mode_ == Mode::Ring) {
+      ring_->wait_for_writes(fd_);
+    }
+    if (preallocated_ && ftruncate(fd_, offset_)) {
+      fprintf(stderr, "Error writing output.");
+      exit(-7);
+    }
+    preallocated_ = false;
+  }
+
+  // Finishes and closes the file descriptor. Through a ring, the writes
+  // still in flight are left to complete in the background.
+  void close()
+  {
+    if (mode_ == Mode::Ring && !preallocated_) {
+      flush();
+      ring_->close_after_writes(fd_);
+    } else {
+      finish();
+      if (::close(fd_)) {
+        fprintf(stderr, "Error writing output.");
+        exit(-7);
+      }
+    }
+    fd_ = -1;
+  }
+
+  // Reserves `length` bytes of disk space for a file opened with -o so
+  // that a large output isn't fragmented. Advisory; failures are ignored.
+  void preallocate(size_t length)
+  {
+    if ((mode_ == Mode::Positional || mode_ == Mode::Ring) && length &&
+        !fallocate(fd_, 0, offset_, static_cast<off_t>(length))) {
+      preallocated_ = true;
+    }
+  }
+
+  // Moves `length` bytes at `offset` in the file open as `in` to the output
+  // without copying them through user space. Returns the number of bytes
+  // moved, which is zero if the kernel can't do this for the output at
+  // hand.
+  size_t copy_from(int in, off_t offset, size_t length)
+  {
+    if (!kernel_copy_ || mode_ == Mode::Memory || mode_ == Mode::Ring) {
+      return 0;
+    }
+    flush();
+    struct stat st;
+    if (mode_ == Mode::Write && (fstat(fd_, &st) || !S_ISREG(st.st_mode))) {
+      kernel_copy_ = false;
+      return 0;
+    }
+    auto start = stats_start(stats);
+    size_t copied = 0;
+    while (copied < length) {
+      ssize_t n;
+      if (mode_ == Mode::Splice) {
+        n = splice(in, &offset, fd_, nullptr, length - copied, SPLICE_F_MORE);
+      } else {
+        n = copy_file_range(in,
+                            &offset,
+                            fd_,
+                            mode_ == Mode::Positional ? &offset_ : nullptr,
+                            length - copied,
+                            0);
+      }
+      if (n <= 0) {
+        // E.g. EINVAL, EXDEV or ENOSYS. Let the caller write the rest.
+        kernel_copy_ = false;
+        break;
+      }
+      copied += static_cast<size_t>(n);
+    }
+    if (stats) {
+      stats->write.record(start, copied, copied);
+    }
+    return copied;
+  }
+
+  // Where the output records --stats, if anywhere.
+  Stats* stats = nullptr;
+
+private:
+  enum class Mode
+  {
+    Memory,
+    Write,
+    Positional,
+    Splice,
+    Ring,
+  };
+
+  struct Region
+  {
+    uint8_t* data;
+    size_t length;
+    size_t capacity;
+    // The ring's output buffer or -1 for memory mapped here.
+    int buffer;
+  };
+
+  static Region allocate(size_t min)
+  {
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t capacity =
+      (std::max<size_t>(min, OUTPUT_REGION_SIZE) + page - 1) / page * page;
+    void* data = mmap(nullptr,
+                      capacity,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1,
+                      0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Out of memory.");
+      exit(-8);
+    }
+    return { static_cast<uint8_t*>(data), 0, capacity, -1 };
+  }
+
+  void release(Region& region)
+  {
+    if (region.buffer != -1) {
+      ring_->release_output(region.buffer);
+    } else {
+      munmap(region.data, region.capacity);
+    }
+  }
+
+  Region take_spare(size_t min)
+  {
+    if (mode_ == Mode::Ring && min <= URING_BUFFER_SIZE) {
+      int buffer = ring_->acquire_output();
+      if (buffer != -1) {
+        return { ring_->buffer(buffer), 0, URING_BUFFER_SIZE, buffer };
+      }
+    }
+    for (size_t i = 0; i < spare_.size(); i++) {
+      if (spare_[i].capacity >= min) {
+        Region region = spare_[i];
+        spare_.erase(spare_.begin() + i);
+        return region;
+      }
+    }
+    return allocate(min);
+  }
+
+  // Writes out all of `iov`, returning the number of system calls it took.
+  size_t submit(std::vector<iovec>& iov)
+  {
+    size_t calls = 0;
+    size_t first = 0;
+    while (first < iov.size()) {
+      int count =
+        static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+      ssize_t n;
+      if (mode_ == Mode::Splice) {
+        n = vmsplice(fd_, &iov[first], count, SPLICE_F_GIFT);
+        if (n < 0 && errno == EINVAL) {
+          // Not a pipe after all.
+          mode_ = Mode::Write;
+          continue;
+        }
+      } else if (mode_ == Mode::Positional) {
+        n = pwritev(fd_, &iov[first], count, offset_);
+      } else {
+        n = writev(fd_, &iov[first], count);
+      }
+      calls++;
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        fprintf(stderr, "Error writing output.");
+        exit(-7);
+      }
+      if (mode_ == Mode::Positional) {
+        offset_ += n;
+      }
+      advance(iov, first, static_cast<size_t>(n));
+    }
+    return calls;
+  }
+
+  // Skips the first `written` bytes of `iov` from index `first` on.
+  static void advance(std::vector<iovec>& iov, size_t& first, size_t written)
+  {
+    while (written && written >= iov[first].iov_len) {
+      written -= iov[first].iov_len;
+      first++;
+    }
+    if (written) {
+      iov[first].iov_base =
+        static_cast<uint8_t*>(iov[first].iov_base) + written;
+      iov[first].iov_len -= written;
+    }
+  }
+
+  // Makes the regions spare again once their bytes are out.
+  void recycle()
+  {
+    for (Region& region : regions_) {
+      if (mode_ == Mode::Splice || spare_.size() >= OUTPUT_SPARE_REGIONS) {
+        // Gifted pages are the pipe's now and must not be written to again.
+        release(region);
+      } else {
+        region.length = 0;
+        spare_.push_back(region);
+      }
+    }
+    regions_.clear();
+    pending_ = 0;
+  }
+
+  IoRing* ring_;
+  int fd_;
+  Mode mode_;
+  off_t offset_;
+  size_t pending_;
+  // Whether copy_from() is still worth trying.
+  bool kernel_copy_;
+  bool preallocated_;
+  // The regions with pending bytes. The last one is being filled.
+  std::vector<Region> regions_;
+  std::vector<Region> spare_;
+};
+
+// The buffers for converting input in steps of `step()` bytes. The
+// intermediate buffers and the output space reserved per step are sized
+// from the step so that the
+// decoder never stops early with OUTPUT_FULL and neither does the encoder
+// unless the input contains unmappable characters. Most conversions go
+// through the transcoder, which only uses the output space.
+//
+// In adaptive mode, the step starts small and is doubled for as long as
+// doing so still makes the conversion noticeably faster.
+class Buffers final
+{
+public:
+  Buffers(size_t step, bool adaptive)
+    : step_(step)
+    , adaptive_(adaptive)
+    , decoder_(nullptr)
+    , encoder_(nullptr)
+    , use_utf16_(false)
+    , sample_bytes_(0)
+    , sample_time_(0)
+    , best_rate_(0.0)
+  {
+  }
+
+  size_t step() const { return step_; }
+
+  bool adaptive() const { return adaptive_; }
+
+  void fit(Decoder& decoder, Encoder& encoder, bool use_utf16)
+  {
+    decoder_ = &decoder;
+    encoder_ = &encoder;
+    use_utf16_ = use_utf16;
+    transcoder.emplace(decoder, encoder, use_utf16);
+    if (use_utf16) {
+      size_t utf16_length =
+        decoder.max_utf16_buffer_length(step_).value_or(step_);
+      output_length =
+        encoder.max_buffer_length_from_utf16_if_no_unmappables(utf16_length)
+          .value_or(step_);
+    } else {
+      utf8_length = decoder.max_utf8_buffer_length(step_).value_or(step_);
+      if (encoder.encoding() == UTF_8_ENCODING) {
+        // The decoder writes straight to the output.
+        output_length = utf8_length;
+      } else {
+        utf8_intermediate.resize(utf8_length);
+        output_length =
+          encoder.max_buffer_length_from_utf8_if_no_unmappables(utf8_length)
+            .value_or(step_);
+      }
+    }
+  }
+
+  // Records that a step of `bytes` bytes took `elapsed` to convert.
+  void measured(size_t bytes, std::chrono::steady_clock::duration elapsed)
+  {
+    sample_bytes_ += bytes;
+    sample_time_ += elapsed;
+    if (sample_bytes_ < std::max<size_t>(ADAPTIVE_SAMPLE_SIZE, 16 * step_)) {
+      return;
+    }
+    double rate = sample_bytes_ / std::chrono::duration<double>(sample_time_)
+                                    .count();
+    sample_bytes_ = 0;
+    sample_time_ = std::chrono::steady_clock::duration(0);
+    if (rate > best_rate_ * 1.05 && step_ < ADAPTIVE_MAX_BUFFER_SIZE) {
+      best_rate_ = rate;
+      step_ *= 2;
+    } else {
+      // Plateaued, so settle on the best size seen.
+      if (rate < best_rate_) {
+        step_ /= 2;
+      }
+      adaptive_ = false;
+    }
+    fit(*decoder_, *encoder_, use_utf16_);
+  }
+
+  std::vector<uint8_t> utf8_intermediate;
+  // Must be reset when the decoder or the encoder is reinitialized.
+  std::optional<Transcoder> transcoder;
+  // How much output space one step of decoding to UTF-8 may need.
+  size_t utf8_length = 0;
+  // How much output space one step of encoding may need.
+  size_t output_length = 0;
+  // Where the conversions using these buffers record --stats, if anywhere.
+  Stats* stats = nullptr;
+
+private:
+  size_t step_;
+  bool adaptive_;
+  Decoder* decoder_;
+  Encoder* encoder_;
+  bool use_utf16_;
+  size_t sample_bytes_;
+  std::chrono::steady_clock::duration sample_time_;
+  double best_rate_;
+};
+
+// Parses a byte count with an optional K or M suffix. "auto" yields 0.
+size_t
+get_size(const char* arg)
+{
+  if (!strcmp(arg, "auto")) {
+    return 0;
+  }
+  char* end;
+  unsigned long long size = strtoull(arg, &end, 10);
+  unsigned long long multiplier = 1;
+  if (*end == 'K' || *end == 'k') {
+    multiplier = 1024;
+    end++;
+  } else if (*end == 'M' || *end == 'm') {
+    multiplier = 1024 * 1024;
+    end++;
+  }
+  // Checked before multiplying so that a huge count can't wrap around.
+  if (*end || end == arg || *arg == '-' ||
+      size > MAX_BUFFER_SIZE / multiplier ||
+      size * multiplier < MIN_BUFFER_SIZE) {
+    fprintf(stderr, "%s is not a valid buffer size; exiting.", arg);
+    exit(-2);
+  }
+  return static_cast<size_t>(size * multiplier);
+}
+
+void
+convert_buffer_via_utf8(Decoder& decoder,
+                        Encoder& encoder,
+                        Buffers& buffers,
+                        gsl::span<const uint8_t> input_buffer,
+                        Output& output,
+                        bool input_ended)
+{
+  // If the target is UTF-8, optimize out the encoder and decode straight
+  // into the output.
+  bool direct = encoder.encoding() == UTF_8_ENCODING;
+  gsl::span<uint8_t> intermediate_buffer(buffers.utf8_intermediate);
+
+  size_t decoder_input_start = 0;
+  for (;;) {
+    size_t decoder_read;
+    size_t decoder_written;
+    uint32_t decoder_result;
+    bool decoder_replaced;
+
+    if (direct) {
+      intermediate_buffer = output.reserve(buffers.utf8_length);
+    }
+    auto start = stats_start(buffers.stats);
+    std::tie(decoder_result, decoder_read, decoder_written, decoder_replaced) =
+      decoder.decode_to_utf8(input_buffer.subspan(decoder_input_start),
+                             intermediate_buffer,
+                             input_ended);
+    if (buffers.stats) {
+      buffers.stats->record_decode(
+        start, decoder_read, decoder_written, decoder_result, decoder_replaced);
+    }
+    decoder_input_start += decoder_read;
+
+    bool last_output = (input_ended && (decoder_result == INPUT_EMPTY));
+
+    // Regardless of whether the intermediate buffer got full
+    // or the input buffer was exhausted, let's process what's
+    // in the intermediate buffer.
+
+    if (direct) {
+      output.commit(decoder_written);
+    } else {
+      size_t encoder_input_start = 0;
+      for (;;) {
+        size_t encoder_read;
+        size_t encoder_written;
+        uint32_t encoder_result;
+        bool encoder_replaced;
+
+        auto start = stats_start(buffers.stats);
+        std::tie(
+          encoder_result, encoder_read, encoder_written, encoder_replaced) =
+          encoder.encode_from_utf8(
+            std::string_view(
+              reinterpret_cast<char*>(intermediate_buffer.data()),
+              intermediate_buffer.size())
+              .substr(encoder_input_start,
+                      decoder_written - encoder_input_start),
+            output.reserve(buffers.output_length),
+            last_output);
+        if (buffers.stats) {
+          buffers.stats->record_encode(start,
+                                       encoder_read,
+                                       encoder_written,
+                                       encoder_result,
+                                       encoder_replaced);
+        }
+        encoder_input_start += encoder_read;
+        output.commit(encoder_written);
+        if (encoder_result == INPUT_EMPTY) {
+          break;
+        }
+      }
+    }
+
+    // Now let's see if we should read again or process the
+    // rest of the current input buffer.
+    if (decoder_result == INPUT_EMPTY) {
+      break;
+    }
+  }
+}
+
+// Converts with the transcoder of `buffers`, which keeps the intermediate
+// UTF-8 or UTF-16 in the cache between decoding and encoding.
+void
+transcode_buffer(Buffers& buffers,
+                 gsl::span<const uint8_t> input_buffer,
+                 Output& output,
+                 bool input_ended)
+{
+  for (;;) {
+    auto start = stats_start(buffers.stats);
+    uint32_t result;
+    size_t read;
+    size_t written;
+    bool replaced;
+    std::tie(result, read, written, replaced) =
+      buffers.transcoder->transcode(
+        input_buffer, output.reserve(buffers.output_length), input_ended);
+    if (buffers.stats) {
+      buffers.stats->record_transcode(start, read, written, result, replaced);
+    }
+    input_buffer = input_buffer.subspan(read);
+    output.commit(written);
+    if (result == INPUT_EMPTY) {
+      break;
+    }
+  }
+}
+
+#define SPLICE_THRESHOLD (64 * 1024)
+#define PASS_THROUGH_STEP_SIZE (4 * 1024)
+
+// Whether the first bytes of a stream, `start`, could still become a BOM
+// with more bytes, so that there is no telling yet whether it starts with
+// one.
+bool
+could_become_bom(gsl::span<const uint8_t> start)
+{
+  if (start.empty()) {
+    return true;
+  }
+  if (start[0] == 0xEF) {
+    return start.size() == 1 || (start.size() == 2 && start[1] == 0xBB);
+  }
+  return start.size() == 1 && (start[0] == 0xFE || start[0] == 0xFF);
+}
+
+// The bytes held back from the start of a stream, fewer than three,
+// followed by as many of `input` as make up the three bytes that a BOM can
+// take.
+std::vector<uint8_t>
+stream_start(const std::vector<uint8_t>& held, gsl::span<const uint8_t> input)
+{
+  std::vector<uint8_t> start(held);
+  start.insert(start.end(),
+               input.begin(),
+               input.begin() + std::min(input.size(), 3 - held.size()));
+  return start;
+}
+
+// Copies input that is valid in the output encoding straight to the output
+// and only runs the bytes around malformed sequences (or, for single-byte
+// encodings, the bytes that don't round-trip) through a decoder and an
+// encoder. Used when the input and output encodings are the same.
+class PassThrough final
+{
+public:
+  static bool supports(const Encoding* encoding)
+  {
+    return encoding == UTF_8_ENCODING ||
+           (encoding->is_single_byte() && encoding->is_ascii_compatible());
+  }
+
+  PassThrough(const Encoding* encoding, Stats* stats)
+    : encoding_(encoding)
+    , decoder_(encoding->new_decoder_without_bom_handling())
+    , encoder_(encoding->new_encoder())
+    , buffers_(PASS_THROUGH_STEP_SIZE, false)
+    , started_(false)
+    , resyncing_(false)
+  {
+    buffers_.fit(*decoder_, *encoder_, false);
+    buffers_.stats = stats;
+    round_trips_.fill(false);
+    for (size_t i = 0; i < 0x80; i++) {
+      round_trips_[i] = true;
+    }
+    if (encoding == UTF_8_ENCODING) {
+      return;
+    }
+    for (size_t i = 0x80; i < round_trips_.size(); i++) {
+      uint8_t byte = static_cast<uint8_t>(i);
+      std::array<uint8_t, 8> utf8;
+      std::array<uint8_t, 16> bytes;
+      size_t utf8_written;
+      size_t bytes_written;
+      bool had_errors;
+      encoding->new_decoder_without_bom_handling_into(*decoder_);
+      std::tie(std::ignore, std::ignore, utf8_written, had_errors) =
+        decoder_->decode_to_utf8(gsl::make_span(&byte, 1), utf8, true);
+      if (had_errors) {
+        continue;
+      }
+      std::tie(std::ignore, std::ignore, bytes_written, had_errors) =
+        encoder_->encode_from_utf8(
+          std::string_view(reinterpret_cast<char*>(utf8.data()), utf8_written),
+          bytes,
+          true);
+      round_trips_[i] = !had_errors && bytes_written == 1 && bytes[0] == byte;
+    }
+    encoding->new_decoder_without_bom_handling_into(*decoder_);
+  }
+
+  // Converts `input`, which starts at `offset` in the file open as `fd` if
+  // `fd` isn't -1. Returns false without consuming anything if the stream
+  // starts with a BOM that would make a BOM-sniffing decoder morph, in
+  // which case the caller must convert `held()` and then the rest of the
+  // stream the regular way. Holds the first bytes back while they could
+  // still become a BOM, as the first read from a pipe can be that short.
+  bool convert(gsl::span<const uint8_t> input,
+               int fd,
+               off_t offset,
+               Output& output,
+               bool last)
+  {
+    if (!started_) {
+      std::vector<uint8_t> start = stream_start(held_, input);
+      if (!last && could_become_bom(start)) {
+        held_.insert(held_.end(), input.begin(), input.end());
+        return true;
+      }
+      size_t bom_length = 0;
+      auto bom = Encoding::for_bom(start);
+      if (bom) {
+        const Encoding* bom_encoding;
+        std::tie(bom_encoding, bom_length) = *bom;
+        if (bom_encoding != encoding_) {
+          return false;
+        }
+      }
+      started_ = true;
+      // The BOM can take held bytes as well as ones from `input`.
+      size_t held_bom_length = std::min(bom_length, held_.size());
+      input = input.subspan(bom_length - held_bom_length);
+      offset += bom_length - held_bom_length;
+      convert_started(gsl::make_span(held_).subspan(held_bom_length),
+                      -1,
+                      0,
+                      output,
+                      false);
+      held_.clear();
+    }
+    convert_started(input, fd, offset, output, last);
+    return true;
+  }
+
+  // The bytes held back from the start of the stream.
+  gsl::span<const uint8_t> held() const { return held_; }
+
+private:
+  void convert_started(gsl::span<const uint8_t> input,
+                       int fd,
+                       off_t offset,
+                       Output& output,
+                       bool last)
+  {
+    size_t pos = 0;
+    if (resyncing_) {
+      pos = decode_through_next_ascii(input, 0, output, last);
+    }
+    while (pos < input.size()) {
+      size_t valid;
+      if (encoding_ == UTF_8_ENCODING) {
+        valid = pos + Encoding::utf8_valid_up_to(input.subspan(pos));
+      } else {
+        valid = pos;
+        for (;;) {
+          valid += Encoding::ascii_valid_up_to(input.subspan(valid));
+          if (valid == input.size() || !round_trips_[input[valid]]) {
+            break;
+          }
+          valid++;
+        }
+      }
+      copy(input.subspan(pos, valid - pos), fd, offset + pos, output);
+      pos = valid;
+      if (pos == input.size()) {
+        break;
+      }
+      if (encoding_ == UTF_8_ENCODING) {
+        pos = decode_through_next_ascii(input, pos, output, last);
+      } else {
+        // Single-byte decoders are stateless, so only the bytes that don't
+        // round-trip need to take the long way.
+        size_t end = pos + 1;
+        while (end < input.size() && !round_trips_[input[end]]) {
+          end++;
+        }
+        convert_buffer_via_utf8(*decoder_,
+                                *encoder_,
+                                buffers_,
+                                input.subspan(pos, end - pos),
+                                output,
+                                false);
+        pos = end;
+      }
+    }
+  }
+
+  // Runs input from `pos` up to and including the next ASCII byte through
+  // the decoder. After an ASCII byte, the UTF-8 decoder can't have a
+  // partial sequence pending, so the fast path can take over again. If there
+  // is no ASCII byte before the end of `input`, the decoder may have a
+  // partial sequence pending across the buffer boundary.
+  size_t decode_through_next_ascii(gsl::span<const uint8_t> input,
+                                   size_t pos,
+                                   Output& output,
+                                   bool last)
+  {
+    size_t end = pos;
+    while (end < input.size() && input[end] >= 0x80) {
+      end++;
+    }
+    resyncing_ = (end == input.size());
+    if (!resyncing_) {
+      end++;
+    }
+    convert_buffer_via_utf8(*decoder_,
+                            *encoder_,
+                            buffers_,
+                            input.subspan(pos, end - pos),
+                            output,
+                            resyncing_ && last);
+    return end;
+  }
+
+  void copy(gsl::span<const uint8_t> bytes,
+            int fd,
+            off_t offset,
+            Output& output)
+  {
+    size_t copied = 0;
+    if (fd != -1 && bytes.size() >= SPLICE_THRESHOLD) {
+      copied = output.copy_from(fd, offset, bytes.size());
+    }
+    output.write(bytes.subspan(copied));
+  }
+
+  const Encoding* encoding_;
+  std::unique_ptr<Decoder> decoder_;
+  std::unique_ptr<Encoder> encoder_;
+  Buffers buffers_;
+  std::array<bool, 256> round_trips_;
+  std::vector<uint8_t> held_;
+  bool started_;
+  bool resyncing_;
+};
+
+// Converts between two single-byte encodings by looking each byte up in
+// the table of what it converts to, 64 bytes at a time with AVX-512 VBMI,
+// 32 with AVX2 or 16 with SSSE3, whichever is the best that the CPU
+// supports. The bytes that don't convert to a single byte (the ones that
+// are unmapped in the input encoding or unmappable in the output encoding)
+// become numeric character references, so the blocks that contain them are
+// converted one byte at a time.
+class SingleByteConverter final
+{
+public:
+  static bool supports(const Encoding* from, const Encoding* to)
+  {
+    return from->is_single_byte() && to->is_single_byte();
+  }
+
+  SingleByteConverter(const Encoding* from, const Encoding* to, Stats* stats)
+    : table_(Transcoder::shared_byte_table(from, to))
+    , stats_(stats)
+    , simd_(simd_level())
+    , all_direct_(true)
+    , marker_(0)
+    , started_(false)
+  {
+    // The bytes that aren't direct look up a byte that no direct byte
+    // converts to, so comparing the results with it finds them. As long as
+    // there are bytes that aren't direct, there is such a byte.
+    std::array<bool, 256> converted_to;
+    converted_to.fill(false);
+    for (size_t i = 0; i < 256; i++) {
+      if (table_.direct[i]) {
+        converted_to[table_.bytes[i]] = true;
+      } else {
+        all_direct_ = false;
+      }
+    }
+    while (marker_ < 255 && converted_to[marker_]) {
+      marker_++;
+    }
+    for (size_t i = 0; i < 256; i++) {
+      lookup_[i] = table_.direct[i] ? table_.bytes[i] : marker_;
+    }
+  }
+
+  // Converts `input`. Returns false without consuming anything if the
+  // stream starts with a BOM, which would make the decoder morph, in which
+  // case the caller must convert `held()` and then the rest of the stream
+  // the regular way. Holds the first bytes back while they could still
+  // become a BOM.
+  bool convert(gsl::span<const uint8_t> input, Output& output, bool last)
+  {
+    if (!started_) {
+      std::vector<uint8_t> start = stream_start(held_, input);
+      if (!last && could_become_bom(start)) {
+        held_.insert(held_.end(), input.begin(), input.end());
+        return true;
+      }
+      if (Encoding::for_bom(start)) {
+        return false;
+      }
+      started_ = true;
+      convert_started(held_, output);
+      held_.clear();
+    }
+    convert_started(input, output);
+    return true;
+  }
+
+  // The bytes held back from the start of the stream.
+  gsl::span<const uint8_t> held() const { return held_; }
+
+private:
+  static constexpr size_t MAX_SEQUENCE_LENGTH =
+    Transcoder::ByteTable::MAX_SEQUENCE_LENGTH;
+
+  void convert_started(gsl::span<const uint8_t> input, Output& output)
+  {
+    while (!input.empty()) {
+      auto start = stats_start(stats_);
+      size_t read;
+      size_t written;
+      bool replaced;
+      std::tie(read, written, replaced) =
+        convert_some(input, output.reserve(MAX_SEQUENCE_LENGTH));
+      if (stats_) {
+        // The table decodes and encodes in one go, so the time goes to
+        // decoding. Every replaced byte becomes a numeric character
+        // reference, so it counts as unmappable, and the unmapped ones
+        // count as malformed too.
+        bool malformed = false;
+        if (replaced) {
+          for (size_t i = 0; i < read && !malformed; i++) {
+            malformed = table_.malformed[input[i]];
+          }
+        }
+        stats_->record_decode(start, read, written, INPUT_EMPTY, malformed);
+        stats_->record_encode(std::chrono::steady_clock::now(),
+                              read,
+                              written,
+                              INPUT_EMPTY,
+                              replaced);
+      }
+      output.commit(written);
+      input = input.subspan(read);
+    }
+  }
+
+  // Converts as much of `src` as fits in `dst` and returns the number of
+  // bytes read and written and whether there were replacements.
+  std::tuple<size_t, size_t, bool> convert_some(gsl::span<const uint8_t> src,
+                                                gsl::span<uint8_t> dst) const
+  {
+    size_t read = 0;
+    size_t written = 0;
+    bool replaced = false;
+#ifdef X86_KERNELS
+    switch (simd_) {
+      case SimdLevel::Avx512Vbmi:
+        std::tie(read, written, replaced) =
+          convert_blocks_avx512vbmi(src, dst);
+        break;
+      case SimdLevel::Avx2:
+        std::tie(read, written, replaced) = convert_blocks_avx2(src, dst);
+        break;
+      case SimdLevel::Ssse3:
+        std::tie(read, written, replaced) = convert_blocks_ssse3(src, dst);
+        break;
+      default:
+        break;
+    }
+#endif
+    size_t tail_read;
+    size_t tail_written;
+    bool tail_replaced;
+    std::tie(tail_read, tail_written, tail_replaced) =
+      convert_bytes(src.subspan(read), dst.subspan(written));
+    return { read + tail_read,
+             written + tail_written,
+             replaced || tail_replaced };
+  }
+
+#ifdef X86_KERNELS
+  // The kernels convert whole blocks for as long as there is room for a
+  // block that is all numeric character references. A block that contains
+  // bytes that aren't direct is converted again one byte at a time.
+
+  __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+  std::tuple<size_t, size_t, bool>
+  convert_blocks_avx512vbmi(gsl::span<const uint8_t> src,
+                            gsl::span<uint8_t> dst) const
+  {
+    // vpermi2b looks up the low seven bits in 128 bytes, so two lookups
+    // cover the table and bit 7 picks between them.
+    const __m512i quarters[4] = {
+      _mm512_loadu_si512(&lookup_[0]),
+      _mm512_loadu_si512(&lookup_[64]),
+      _mm512_loadu_si512(&lookup_[128]),
+      _mm512_loadu_si512(&lookup_[192]),
+    };
+    const __m512i marker = _mm512_set1_epi8(static_cast<char>(marker_));
+    size_t read = 0;
+    size_t written = 0;
+    bool replaced = false;
+    while (src.size() - read >= 64 &&
+           dst.size() - written >= 64 * MAX_SEQUENCE_LENGTH) {
+      __m512i bytes = _mm512_loadu_si512(&src[read]);
+      __m512i converted = _mm512_mask_blend_epi8(
+        _mm512_movepi8_mask(bytes),
+        _mm512_permutex2var_epi8(quarters[0], bytes, quarters[1]),
+        _mm512_permutex2var_epi8(quarters[2], bytes, quarters[3]));
+      if (!all_direct_ && _mm512_cmpeq_epi8_mask(converted, marker)) {
+        size_t block_written;
+        bool block_replaced;
+        std::tie(std::ignore, block_written, block_replaced) =
+          convert_bytes(src.subspan(read, 64), dst.subspan(written));
+        written += block_written;
+        replaced |= block_replaced;
+      } else {
+        _mm512_storeu_si512(&dst[written], converted);
+        written += 64;
+      }
+      read += 64;
+    }
+    return { read, written, replaced };
+  }
+
+  __attribute__((target("avx2"))) std::tuple<size_t, size_t, bool>
+  convert_blocks_avx2(gsl::span<const uint8_t> src,
+                      gsl::span<uint8_t> dst) const
+  {
+    __m256i rows[16];
+    for (size_t h = 0; h < 16; h++) {
+      rows[h] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(&lookup_[16 * h])));
+    }
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+    const __m256i marker = _mm256_set1_epi8(static_cast<char>(marker_));
+    size_t read = 0;
+    size_t written = 0;
+    bool replaced = false;
+    while (src.size() - read >= 32 &&
+           dst.size() - written >= 32 * MAX_SEQUENCE_LENGTH) {
+      __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src[read]));
+      // Look the low nibble up in each row of sixteen bytes and then narrow
+      // the sixteen candidates down by the bits of the high nibble, moving
+      // each bit to bit 7, which is what the blend looks at.
+      __m256i low = _mm256_and_si256(bytes, low_nibble);
+      __m256i candidates[16];
+      for (size_t h = 0; h < 16; h++) {
+        candidates[h] = _mm256_shuffle_epi8(rows[h], low);
+      }
+      __m256i bits = _mm256_slli_epi16(bytes, 3);
+      for (size_t h = 0; h < 8; h++) {
+        candidates[h] =
+          _mm256_blendv_epi8(candidates[2 * h], candidates[2 * h + 1], bits);
+      }
+      bits = _mm256_slli_epi16(bytes, 2);
+      for (size_t h = 0; h < 4; h++) {
+        candidates[h] =
+          _mm256_blendv_epi8(candidates[2 * h], candidates[2 * h + 1], bits);
+      }
+      bits = _mm256_slli_epi16(bytes, 1);
+      for (size_t h = 0; h < 2; h++) {
+        candidates[h] =
+          _mm256_blendv_epi8(candidates[2 * h], candidates[2 * h + 1], bits);
+      }
+      candidates[0] = _mm256_blendv_epi8(candidates[0], candidates[1], bytes);
+      if (!all_direct_ &&
+          _mm256_movemask_epi8(_mm256_cmpeq_epi8(candidates[0], marker))) {
+        size_t block_written;
+        bool block_replaced;
+        std::tie(std::ignore, block_written, block_replaced) =
+          convert_bytes(src.subspan(read, 32), dst.subspan(written));
+        written += block_written;
+        replaced |= block_replaced;
+      } else {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst[written]),
+                            candidates[0]);
+        written += 32;
+      }
+      read += 32;
+    }
+    return { read, written, replaced };
+  }
+
+  __attribute__((target("ssse3"))) std::tuple<size_t, size_t, bool>
+  convert_blocks_ssse3(gsl::span<const uint8_t> src,
+                       gsl::span<uint8_t> dst) const
+  {
+    const __m128i saturate = _mm_set1_epi8(0x70);
+    const __m128i marker = _mm_set1_epi8(static_cast<char>(marker_));
+    size_t read = 0;
+    size_t written = 0;
+    bool replaced = false;
+    while (src.size() - read >= 16 &&
+           dst.size() - written >= 16 * MAX_SEQUENCE_LENGTH) {
+      __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[read]));
+      // Without a byte blend, it takes fewer instructions to look the bytes
+      // up in every row such that only the right row yields a nonzero
+      // result: after XORing with the row's high nibble, only the bytes
+      // that belong to the row have a zero high nibble, and the saturating
+      // add sets bit 7, which makes the shuffle output zero, in the others.
+      __m128i converted = _mm_setzero_si128();
+      for (size_t h = 0; h < 16; h++) {
+        __m128i index = _mm_adds_epu8(
+          _mm_xor_si128(bytes, _mm_set1_epi8(static_cast<char>(h << 4))),
+          saturate);
+        converted = _mm_or_si128(
+          converted,
+          _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(&lookup_[16 * h])),
+            index));
+      }
+      if (!all_direct_ &&
+          _mm_movemask_epi8(_mm_cmpeq_epi8(converted, marker))) {
+        size_t block_written;
+        bool block_replaced;
+        std::tie(std::ignore, block_written, block_replaced) =
+          convert_bytes(src.subspan(read, 16), dst.subspan(written));
+        written += block_written;
+        replaced |= block_replaced;
+      } else {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[written]), converted);
+        written += 16;
+      }
+      read += 16;
+    }
+    return { read, written, replaced };
+  }
+#endif
+
+  // Converts as much of `src` as fits in `dst` one byte at a time.
+  std::tuple<size_t, size_t, bool> convert_bytes(gsl::span<const uint8_t> src,
+                                                 gsl::span<uint8_t> dst) const
+  {
+    size_t read = 0;
+    size_t written = 0;
+    bool replaced = false;
+    for (; read < src.size(); read++) {
+      uint8_t byte = src[read];
+      if (table_.direct[byte]) {
+        if (written == dst.size()) {
+          break;
+        }
+        dst[written++] = table_.bytes[byte];
+        continue;
+      }
+      size_t length = table_.lengths[byte];
+      if (length > dst.size() - written) {
+        break;
+      }
+      memcpy(&dst[written], table_.sequences[byte].data(), length);
+      written += length;
+      replaced |= table_.replaced[byte];
+    }
+    return { read, written, replaced };
+  }
+
+  const Transcoder::ByteTable& table_;
+  // Null unless --stats was given.
+  Stats* stats_;
+  SimdLevel simd_;
+  // Whether every byte converts to a single byte.
+  bool all_direct_;
+  // What the bytes that aren't direct look up in `lookup_`.
+  uint8_t marker_;
+  // What each byte converts to, or the marker.
+  std::array<uint8_t, 256> lookup_;
+  std::vector<uint8_t> held_;
+  bool started_;
+};
+
+// Feeds `input` to the transcoder of `buffers` `buffers.step()` bytes at a
+// time, which is what the buffers are sized for.
+void
+convert_in_steps(Buffers& buffers,
+                 gsl::span<const uint8_t> input,
+                 Output& output,
+                 bool last)
+{
+  do {
+    gsl::span<const uint8_t> step =
+      input.first(std::min(buffers.step(), input.size()));
+    input = input.subspan(step.size());
+    bool step_last = last && input.empty();
+    auto start = std::chrono::steady_clock::time_point();
+    if (buffers.adaptive()) {
+      start = std::chrono::steady_clock::now();
+    }
+    transcode_buffer(buffers, step, output, step_last);
+    if (buffers.adaptive()) {
+      buffers.measured(step.size(), std::chrono::steady_clock::now() - start);
+    }
+  } while (!input.empty());
+}
+
+// The state of converting one stream, which is either stdin or the
+// concatenation of the input files.
+struct Conversion
+{
+  Decoder& decoder;
+  Encoder& encoder;
+  bool use_utf16;
+  unsigned jobs;
+  Buffers buffers;
+  std::optional<PassThrough> pass_through;
+  std::optional<SingleByteConverter> single_byte;
+  // Null unless --stats was given.
+  Stats* stats;
+  // Whether batch and check modes detect the encoding of each file on its
+  // own.
+  bool detect;
+};
+
+void
+convert_buffer(Conversion& conversion,
+               gsl::span<const uint8_t> input,
+               int fd,
+               off_t offset,
+               Output& output,
+               bool last)
+{
+  if (conversion.pass_through) {
+    if (conversion.pass_through->convert(input, fd, offset, output, last)) {
+      return;
+    }
+    if (!conversion.pass_through->held().empty()) {
+      convert_in_steps(
+        conversion.buffers, conversion.pass_through->held(), output, false);
+    }
+    conversion.pass_through.reset();
+  }
+  if (conversion.single_byte) {
+    if (conversion.single_byte->convert(input, output, last)) {
+      return;
+    }
+    if (!conversion.single_byte->held().empty()) {
+      convert_in_steps(
+        conversion.buffers, conversion.single_byte->held(), output, false);
+    }
+    conversion.single_byte.reset();
+  }
+  convert_in_steps(conversion.buffers, input, output, last);
+}
+
+void
+convert(Conversion& conversion, FILE* read, Output& output, bool last)
+{
+  std::vector<uint8_t> input_buffer;
+
+  bool current_input_ended = false;
+  while (!current_input_ended) {
+    // Follows the step size as adaptive mode changes it.
+    input_buffer.resize(conversion.buffers.step());
+    size_t decoder_input_end = timed_fread(
+      input_buffer.data(), input_buffer.size(), read, conversion.stats);
+    if (ferror(read)) {
+      fprintf(stderr, "Error reading input.");
+      exit(-5);
+    }
+    current_input_ended = (decoder_input_end == 0);
+    bool input_ended = last && current_input_ended;
+    convert_buffer(
+      conversion,
+      gsl::span<const uint8_t>(input_buffer).subspan(0, decoder_input_end),
+      -1,
+      0,
+      output,
+      input_ended);
+  }
+}
+
+// Converts what `fd` delivers as soon as read() returns it instead of
+// waiting for a full buffer, for following logs and other streams where
+// latency matters more than throughput. The output is flushed whenever the
+// input read contains a line feed and otherwise once output has been
+// pending for `deadline`. The decoder carries partial sequences over from
+// one read to the next. (With UTF-16 input, a 0x0A byte need not be a line
+// feed, which only makes for an early flush.)
+void
+convert_lines(Conversion& conversion,
+              int fd,
+              Output& output,
+              bool last,
+              std::chrono::milliseconds deadline)
+{
+  std::vector<uint8_t> input_buffer;
+  std::chrono::steady_clock::time_point pending_since;
+  for (;;) {
+    if (output.pending()) {
+      auto left = std::chrono::ceil<std::chrono::milliseconds>(
+        pending_since + deadline - std::chrono::steady_clock::now());
+      struct pollfd readable = { fd, POLLIN, 0 };
+      int ready = poll(
+        &readable, 1, left.count() > 0 ? static_cast<int>(left.count()) : 0);
+      if (ready < 0 && errno != EINTR) {
+        fprintf(stderr, "Error reading input.");
+        exit(-5);
+      }
+      if (!ready) {
+        output.flush();
+      }
+      if (ready <= 0) {
+        continue;
+      }
+    }
+    input_buffer.resize(conversion.buffers.step());
+    auto start = stats_start(conversion.stats);
+    ssize_t n = read(fd, input_buffer.data(), input_buffer.size());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error reading input.");
+      exit(-5);
+    }
+    size_t length = static_cast<size_t>(n);
+    if (conversion.stats) {
+      conversion.stats->read.record(start, length, length);
+    }
+    bool was_pending = output.pending();
+    convert_buffer(conversion,
+                   gsl::span<const uint8_t>(input_buffer).subspan(0, length),
+                   -1,
+                   0,
+                   output,
+                   last && !length);
+    if (!length) {
+      return;
+    }
+    if (memchr(input_buffer.data(), '\n', length)) {
+      output.flush();
+    } else if (!was_pending && output.pending()) {
+      pending_since = std::chrono::steady_clock::now();
+    }
+  }
+}
+
+// Reads a sequence of files through an `IoRing`, keeping reads in flight
+// ahead of the conversion, also across the boundaries of the files, and
+// hands the data out in file order. `next_file` returns the next file
+// descriptor to read, which the reader closes once done with it, or -1
+// when there are no more files. Files other than regular files are read
+// one buffer at a time, since where they end isn't known up front.
+class RingInput final
+{
+public:
+  struct Chunk
+  {
+    gsl::span<const uint8_t> data;
+    // Set on the last chunk of each file, which may be empty.
+    bool file_end;
+    int buffer;
+  };
+
+  RingInput(IoRing& ring, std::function<int()> next_file, Stats* stats)
+    : ring_(ring)
+    , next_file_(std::move(next_file))
+    , stats_(stats)
+    , fd_(-1)
+    , size_(0)
+    , offset_(0)
+    , streaming_(false)
+    , exhausted_(false)
+  {
+    for (int i = URING_INPUT_BUFFERS - 1; i >= 0; i--) {
+      free_buffers_.push_back(i);
+    }
+  }
+
+  // Waits for the next chunk. Returns false after the last file.
+  bool next(Chunk& chunk)
+  {
+    fill();
+    if (reads_.empty()) {
+      return false;
+    }
+    Read read = reads_.front();
+    reads_.pop_front();
+    auto start = stats_start(stats_);
+    size_t length = read.op != -1 ? ring_.wait(read.op) : 0;
+    if (stats_) {
+      stats_->read.record(start, length, length);
+    }
+    if (read.streaming) {
+      streaming_ = false;
+      read.file_end = !length;
+    }
+    chunk.data = gsl::span<const uint8_t>(
+      read.buffer != -1 ? ring_.buffer(read.buffer) : nullptr, length);
+    chunk.file_end = read.file_end;
+    chunk.buffer = read.buffer;
+    if (read.file_end) {
+      if (read.fd != STDIN_FILENO) {
+        close(read.fd);
+      }
+      if (read.fd == fd_) {
+        fd_ = -1;
+      }
+    }
+    return true;
+  }
+
+  // Gives the chunk's buffer back for reading ahead.
+  void recycle(const Chunk& chunk)
+  {
+    if (chunk.buffer != -1) {
+      free_buffers_.push_back(chunk.buffer);
+    }
+    fill();
+  }
+
+private:
+  struct Read
+  {
+    int op;
+    int buffer;
+    int fd;
+    bool file_end;
+    bool streaming;
+  };
+
+  // Starts as many reads as there are free buffers for.
+  void fill()
+  {
+    while (!exhausted_ && !streaming_) {
+      if (fd_ == -1) {
+        fd_ = next_file_();
+        if (fd_ == -1) {
+          exhausted_ = true;
+          break;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) || !S_ISREG(st.st_mode)) {
+          size_ = -1;
+        } else {
+          size_ = st.st_size;
+        }
+        // Reads from the file position, which isn't the start for a
+        // stdin that something else has already read from.
+        offset_ = 0;
+        if (size_ != -1) {
+          offset_ = std::max<off_t>(0, lseek(fd_, 0, SEEK_CUR));
+        }
+        if (size_ != -1 && offset_ >= size_) {
+          reads_.push_back({ -1, -1, fd_, true, false });
+          fd_ = -1;
+          continue;
+        }
+      }
+      if (free_buffers_.empty()) {
+        break;
+      }
+      int buffer = free_buffers_.back();
+      free_buffers_.pop_back();
+      if (size_ == -1) {
+        streaming_ = true;
+        int op = ring_.read(fd_, buffer, URING_BUFFER_SIZE, -1);
+        reads_.push_back({ op, buffer, fd_, false, true });
+        continue;
+      }
+      size_t length = std::min<size_t>(URING_BUFFER_SIZE,
+                                       static_cast<size_t>(size_ - offset_));
+      int op = ring_.read(fd_, buffer, length, offset_);
+      offset_ += length;
+      bool file_end = (offset_ == size_);
+      reads_.push_back({ op, buffer, fd_, file_end, false });
+      if (file_end) {
+        // The descriptor stays open until the reads have completed.
+        fd_ = -1;
+      }
+    }
+    ring_.submit();
+  }
+
+  IoRing& ring_;
+  std::function<int()> next_file_;
+  Stats* stats_;
+  // The file being read ahead, or -1 if the next one needs opening.
+  int fd_;
+  off_t size_;
+  off_t offset_;
+  // Whether a read of a file of unknown length is in flight.
+  bool streaming_;
+  bool exhausted_;
+  std::deque<Read> reads_;
+  std::vector<int> free_buffers_;
+};
+
+// Converts the files at `paths` (stdin if there are none) as one stream,
+// reading them through `ring`.
+void
+convert_ring(Conversion& conversion,
+             IoRing& ring,
+             const std::vector<const char*>& paths,
+             Output& output)
+{
+  size_t next = 0;
+  RingInput input(ring,
+                  [&]() {
+                    if (paths.empty()) {
+                      return next++ ? -1 : STDIN_FILENO;
+                    }
+                    if (next == paths.size()) {
+                      return -1;
+                    }
+                    const char* path = paths[next++];
+                    int fd = open(path, O_RDONLY);
+                    if (fd == -1) {
+                      fprintf(
+                        stderr, "Cannot open %s for reading; exiting.", path);
+                      exit(-4);
+                    }
+                    return fd;
+                  },
+                  conversion.stats);
+  RingInput::Chunk chunk;
+  while (input.next(chunk)) {
+    convert_buffer(conversion, chunk.data, -1, 0, output, false);
+    input.recycle(chunk);
+  }
+  convert_buffer(conversion, gsl::span<const uint8_t>(), -1, 0, output, true);
+}
+
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+
+// Returns the byte values after which a decoder for `encoding` is back in
+// its initial state whatever state it was in before the byte, or
+// `std::nullopt` if `encoding` has no such bytes that could be relied on.
+// Input can be cut after any of these bytes and the pieces decoded
+// independently.
+std::optional<std::array<bool, 256>>
+resync_bytes(const Encoding* encoding)
+{
+  std::array<bool, 256> resets;
+  if (encoding->is_single_byte()) {
+    resets.fill(true);
+    return resets;
+  }
+  resets.fill(false);
+  if (encoding == UTF_8_ENCODING) {
+    // An ASCII byte is never a continuation byte, so it ends any partial
+    // sequence as malformed and is then decoded as itself.
+    for (size_t i = 0; i < 0x80; i++) {
+      resets[i] = true;
+    }
+    return resets;
+  }
+  if (encoding == GBK_ENCODING || encoding == GB18030_ENCODING ||
+      encoding == BIG5_ENCODING || encoding == EUC_KR_ENCODING ||
+      encoding == SHIFT_JIS_ENCODING || encoding == EUC_JP_ENCODING) {
+    // Bytes below 0x40 are never trail bytes, so a pending lead is reported
+    // as malformed and the byte is then decoded as ASCII. The exception is
+    // digits, which are the second and fourth bytes of gb18030 four-byte
+    // sequences.
+    for (size_t i = 0; i < 0x40; i++) {
+      resets[i] = (i < '0' || i > '9');
+    }
+    return resets;
+  }
+  // ISO-2022-JP has states that span any number of bytes, and a UTF-16
+  // stream can only be cut at an even offset that isn't in the middle of a
+  // surrogate pair.
+  return std::nullopt;
+}
+
+// The input can be cut into pieces whose conversion is independent if the
+// decoder can be resynchronized and the encoder keeps no state between
+// characters, which holds for all encoders other than ISO-2022-JP.
+bool
+can_convert_in_parallel(const Conversion& conversion)
+{
+  return !conversion.pass_through &&
+         resync_bytes(conversion.decoder.encoding()) &&
+         conversion.encoder.encoding() != ISO_2022_JP_ENCODING;
+}
+
+// Converts `input` on `conversion.jobs` threads. The input is cut into
+// chunks just after bytes that resynchronize the decoder. The stream's
+// decoder converts the part before the first cut on the calling thread.
+// The chunks are converted into memory by the workers, each with its own
+// decoder and encoder, and written out in order by the calling thread.
+//
+// Each worker checks the seam at the end of its chunk by ending its
+// decoder's stream: If that produces output, the decoder had a partial
+// sequence pending at the cut, and the serial conversion would have
+// continued it into the next chunk. In that case, this chunk and
+// everything after it is left unconverted.
+//
+// Returns the part at the end of `input` that was left unconverted and
+// that the caller must convert serially.
+gsl::span<const uint8_t>
+convert_in_parallel(Conversion& conversion,
+                    gsl::span<const uint8_t> input,
+                    Output& output)
+{
+  const Encoding* input_encoding = conversion.decoder.encoding();
+  const Encoding* output_encoding = conversion.encoder.encoding();
+  std::array<bool, 256> resets = *resync_bytes(input_encoding);
+
+  auto resync_at_or_after = [&](size_t from) {
+    for (size_t i = from; i < input.size(); i++) {
+      if (resets[input[i]]) {
+        return i + 1;
+      }
+    }
+    return SIZE_MAX;
+  };
+  std::vector<size_t> cuts;
+  size_t cut = resync_at_or_after(0);
+  while (cut != SIZE_MAX) {
+    cuts.push_back(cut);
+    if (input.size() - cut <= PARALLEL_CHUNK_SIZE) {
+      break;
+    }
+    cut = resync_at_or_after(cut + PARALLEL_CHUNK_SIZE);
+  }
+  if (!cuts.empty()) {
+    // Let the last chunk end at the last resynchronization point. A partial
+    // sequence at the very end of the input may continue in the next file.
+    for (size_t i = input.size(); i > cuts.back(); i--) {
+      if (resets[input[i - 1]]) {
+        cuts.push_back(i);
+        break;
+      }
+    }
+  }
+  if (cuts.size() < 3) {
+    return input;
+  }
+  convert_buffer(conversion, input.first(cuts.front()), -1, 0, output, false);
+
+  struct Chunk
+  {
+    std::unique_ptr<Output> output;
+    bool seam_ok = false;
+    bool done = false;
+  };
+  size_t chunk_count = cuts.size() - 1;
+  std::vector<Chunk> chunks(chunk_count);
+  // Don't let the workers get arbitrarily far ahead of the writer.
+  size_t window = 2 * conversion.jobs;
+  size_t next = 0;
+  size_t written = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  bool use_utf16 = conversion.use_utf16;
+  size_t step = conversion.buffers.step();
+  std::vector<Stats> worker_stats(conversion.jobs);
+  auto worker = [&](unsigned w) {
+    std::unique_ptr<Decoder> decoder =
+      input_encoding->new_decoder_without_bom_handling();
+    std::unique_ptr<Encoder> encoder = output_encoding->new_encoder();
+    Buffers buffers(step, false);
+    buffers.fit(*decoder, *encoder, use_utf16);
+    if (conversion.stats) {
+      buffers.stats = &worker_stats[w];
+    }
+    for (;;) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() {
+          return next == chunk_count || next < written + window;
+        });
+        if (next == chunk_count) {
+          return;
+        }
+        i = next++;
+      }
+      input_encoding->new_decoder_without_bom_handling_into(*decoder);
+      output_encoding->new_encoder_into(*encoder);
+      buffers.transcoder->reset();
+      gsl::span<const uint8_t> chunk =
+        input.subspan(cuts[i], cuts[i + 1] - cuts[i]);
+      auto memory = std::make_unique<Output>();
+      convert_in_steps(buffers, chunk, *memory, false);
+      std::array<uint8_t, 16> flushed;
+      size_t flushed_length;
+      std::tie(std::ignore, std::ignore, flushed_length, std::ignore) =
+        decoder->decode_to_utf8(gsl::span<const uint8_t>(), flushed, true);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        chunks[i].output = std::move(memory);
+        chunks[i].seam_ok = (flushed_length == 0);
+        chunks[i].done = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < conversion.jobs; i++) {
+    workers.emplace_back(worker, i);
+  }
+  while (written < chunk_count) {
+    std::unique_ptr<Output> converted;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return chunks[written].done; });
+      if (!chunks[written].seam_ok) {
+        next = chunk_count;
+      }
+      converted = std::move(chunks[written].output);
+    }
+    if (!chunks[written].seam_ok) {
+      break;
+    }
+    // Hands the chunk's regions to the output without copying them.
+    output.take(*converted);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      written++;
+    }
+    cv.notify_all();
+  }
+  cv.notify_all();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  if (conversion.stats) {
+    for (Stats& stats : worker_stats) {
+      conversion.stats->merge(stats);
+    }
+  }
+  return input.subspan(cuts[written]);
+}
+
+// Converts the whole of a regular file in one go by mapping it into memory.
+// Returns false without consuming any input if `fd` isn't a regular file or
+// can't be mapped, in which case the caller should fall back to `convert()`.
+bool
+convert_mapped(Conversion& conversion, int fd, Output& output, bool last)
+{
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+      st.st_size != static_cast<off_t>(static_cast<size_t>(st.st_size))) {
+    return false;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void* map = nullptr;
+  if (size) {
+    map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    // The hints are advisory, so failures are harmless and ignored.
+    madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, size, MADV_HUGEPAGE);
+#endif
+  }
+  gsl::span<const uint8_t> input(static_cast<const uint8_t*>(map), size);
+  if (conversion.jobs > 1 && can_convert_in_parallel(conversion) &&
+      size >= 2 * PARALLEL_CHUNK_SIZE) {
+    // Let the stream's own decoder see the first bytes so that BOM sniffing
+    // happens exactly as in the serial case.
+    convert_buffer(conversion, input.first(3), fd, 0, output, false);
+    input = input.subspan(3);
+    if (can_convert_in_parallel(conversion)) {
+      input = convert_in_parallel(conversion, input, output);
+    }
+  }
+  convert_buffer(conversion, input, fd, size - input.size(), output, last);
+  if (map) {
+    munmap(map, size);
+  }
+  return true;
+}
+
+#define PIPELINE_BUFFER_SIZE (256 * 1024)
+#define PIPELINE_BUFFER_COUNT 8
+
+// A bounded queue for handing buffer pointers from exactly one producer
+// thread to exactly one consumer thread without locking.
+template<class T, size_t N>
+class SpscQueue final
+{
+  static_assert(N && !(N & (N - 1)), "Capacity must be a power of two.");
+
+public:
+  bool try_push(T value)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    slots_[tail & (N - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T& value)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots_[head & (N - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::array<T, N> slots_;
+  // Kept on separate cache lines so that the two sides don't contend.
+  alignas(64) std::atomic<size_t> head_{ 0 };
+  alignas(64) std::atomic<size_t> tail_{ 0 };
+};
+
+struct PipelineBuffer
+{
+  std::vector<uint8_t> data;
+  size_t length;
+  // Set on the buffer that follows the last byte of the stream.
+  bool end;
+};
+
+typedef SpscQueue<PipelineBuffer*, PIPELINE_BUFFER_COUNT> PipelineQueue;
+
+// Waits until `attempt` succeeds, charging the wait to `stage`. Spins
+// briefly and then backs off to sleeping so that a stage waiting on a slow
+// disk or pipe doesn't burn a core.
+template<class F>
+void
+wait_for(F attempt, PipelineStage& stage)
+{
+  if (attempt()) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned spins = 0; !attempt(); spins++) {
+    if (spins < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+  stage.stalled += std::chrono::steady_clock::now() - start;
+}
+
+PipelineBuffer*
+pop(PipelineQueue& queue, PipelineStage& stage)
+{
+  PipelineBuffer* buffer;
+  wait_for([&] { return queue.try_pop(buffer); }, stage);
+  return buffer;
+}
+
+void
+push(PipelineQueue& queue, PipelineBuffer* buffer, PipelineStage& stage)
+{
+  wait_for([&] { return queue.try_push(buffer); }, stage);
+}
+
+typedef SpscQueue<Output*, PIPELINE_BUFFER_COUNT> PipelineOutputQueue;
+
+Output*
+pop(PipelineOutputQueue& queue, PipelineStage& stage)
+{
+  Output* output;
+  wait_for([&] { return queue.try_pop(output); }, stage);
+  return output;
+}
+
+void
+push(PipelineOutputQueue& queue, Output* output, PipelineStage& stage)
+{
+  wait_for([&] { return queue.try_push(output); }, stage);
+}
+
+// Converts the files at `paths` (stdin if there are none) as one stream,
+// with a reader thread, the calling thread transcoding and a writer thread
+// passing recycled buffers to each other. The transcoder converts into
+// in-memory outputs whose regions the writer takes over without copying.
+// With --stats, the report tells how long each stage waited for the
+// others.
+void
+convert_pipelined(Conversion& conversion,
+                  const std::vector<const char*>& paths,
+                  Output& output)
+{
+  std::array<PipelineBuffer, PIPELINE_BUFFER_COUNT> input_buffers;
+  // One fewer than the queue holds so that the end marker always fits.
+  std::array<Output, PIPELINE_BUFFER_COUNT - 1> staged_outputs;
+  PipelineQueue input_free, input_full;
+  PipelineOutputQueue output_free, output_full;
+  for (PipelineBuffer& buffer : input_buffers) {
+    buffer.data.resize(PIPELINE_BUFFER_SIZE);
+    input_free.try_push(&buffer);
+  }
+  for (Output& staged : staged_outputs) {
+    output_free.try_push(&staged);
+  }
+  PipelineStage reading{ "reader", {}, {} };
+  PipelineStage transcoding{ "transcoder", {}, {} };
+  PipelineStage writing{ "writer", {}, {} };
+  Stats reader_stats, writer_stats;
+  Stats* output_stats = output.stats;
+  if (conversion.stats) {
+    output.stats = &writer_stats;
+  }
+  auto start = std::chrono::steady_clock::now();
+
+  std::thread reader([&] {
+    PipelineBuffer* buffer = pop(input_free, reading);
+    size_t i = 0;
+    do {
+      FILE* read = stdin;
+      if (!paths.empty()) {
+        read = fopen(paths[i], "rb");
+        if (!read) {
+          fprintf(stderr, "Cannot open %s for reading; exiting.", paths[i]);
+          exit(-4);
+        }
+      }
+      for (;;) {
+        buffer->length =
+          timed_fread(buffer->data.data(),
+                      buffer->data.size(),
+                      read,
+                      conversion.stats ? &reader_stats : nullptr);
+        if (ferror(read)) {
+          fprintf(stderr, "Error reading input.");
+          exit(-5);
+        }
+        if (!buffer->length) {
+          break;
+        }
+        buffer->end = false;
+        push(input_full, buffer, reading);
+        buffer = pop(input_free, reading);
+      }
+      if (read != stdin) {
+        fclose(read);
+      }
+    } while (++i < paths.size());
+    buffer->end = true;
+    push(input_full, buffer, reading);
+    reading.total = std::chrono::steady_clock::now() - start;
+  });
+
+  std::thread writer([&] {
+    // A null output marks the end of the stream.
+    while (Output* staged = pop(output_full, writing)) {
+      output.take(*staged);
+      push(output_free, staged, writing);
+    }
+    output.flush();
+    writing.total = std::chrono::steady_clock::now() - start;
+  });
+
+  Output* staged = pop(output_free, transcoding);
+  for (;;) {
+    PipelineBuffer* buffer = pop(input_full, transcoding);
+    bool end = buffer->end;
+    convert_buffer(
+      conversion,
+      gsl::span<const uint8_t>(buffer->data.data(), buffer->length),
+      -1,
+      0,
+      *staged,
+      end);
+    push(input_free, buffer, transcoding);
+    if (staged->pending() >= PIPELINE_BUFFER_SIZE || end) {
+      push(output_full, staged, transcoding);
+      staged = end ? nullptr : pop(output_free, transcoding);
+    }
+    if (end) {
+      break;
+    }
+  }
+  push(output_full, nullptr, transcoding);
+  transcoding.total = std::chrono::steady_clock::now() - start;
+
+  reader.join();
+  writer.join();
+  output.stats = output_stats;
+  if (conversion.stats) {
+    conversion.stats->merge(reader_stats);
+    conversion.stats->merge(writer_stats);
+    conversion.stats->pipeline = { reading, transcoding, writing };
+  }
+}
+
+// Returns the files to convert in batch mode: the arguments, with @FILE
+// standing for the newline-separated paths listed in FILE, or, if there are
+// no arguments, the NUL-separated paths on stdin (as from find -print0).
+std::vector<std::string>
+batch_paths(char** begin, char** end)
+{
+  std::vector<std::string> paths;
+  auto read_list = [&](FILE* list, int separator) {
+    std::string path;
+    for (int c; (c = getc(list)) != EOF;) {
+      if (c != separator) {
+        path.push_back(static_cast<char>(c));
+      } else if (!path.empty()) {
+        paths.push_back(std::move(path));
+        path.clear();
+      }
+    }
+    if (ferror(list)) {
+      fprintf(stderr, "Error reading input.");
+      exit(-5);
+    }
+    if (!path.empty()) {
+      paths.push_back(std::move(path));
+    }
+  };
+  if (begin == end) {
+    read_list(stdin, '\0');
+  }
+  for (char** arg = begin; arg != end; arg++) {
+    if (**arg != '@') {
+      paths.push_back(*arg);
+      continue;
+    }
+    FILE* list = fopen(*arg + 1, "rb");
+    if (!list) {
+      fprintf(stderr, "Cannot open %s for reading; exiting.", *arg + 1);
+      exit(-4);
+    }
+    read_list(list, '\n');
+    fclose(list);
+  }
+  return paths;
+}
+
+// A queue of file indices per worker. Each worker starts with a contiguous
+// share of the files and takes from the front of its own queue. Once that
+// is empty, it steals from the back of another worker's queue, so a worker
+// that draws a run of large files doesn't hold up the rest.
+class WorkQueues final
+{
+public:
+  WorkQueues(size_t count, unsigned workers)
+    : queues_(workers)
+  {
+    for (unsigned w = 0; w < workers; w++) {
+      for (size_t i = count * w / workers; i < count * (w + 1) / workers;
+           i++) {
+        queues_[w].indices.push_back(i);
+      }
+    }
+  }
+
+  bool take(unsigned worker, size_t& index)
+  {
+    {
+      Queue& own = queues_[worker];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.indices.empty()) {
+        index = own.indices.front();
+        own.indices.pop_front();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < queues_.size(); i++) {
+      Queue& victim = queues_[(worker + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.indices.empty()) {
+        index = victim.indices.back();
+        victim.indices.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+private:
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<size_t> indices;
+  };
+
+  std::vector<Queue> queues_;
+};
+
+// Returns where batch mode writes the conversion of `path`, which is the
+// same relative path under `dir`, and creates the directories leading to
+// it, including `dir`. `last_dir` remembers the most recently created
+// directory so that files from the same directory don't repeat the mkdir
+// calls.
+std::string
+batch_output_path(const char* dir,
+                  const std::string& path,
+                  std::string& last_dir)
+{
+  size_t start = path.find_first_not_of('/');
+  if (start == std::string::npos) {
+    start = path.size();
+  }
+  std::string relative = path.substr(start);
+  if (relative.empty() || relative == ".." || !relative.compare(0, 3, "../") ||
+      relative.find("/../") != std::string::npos ||
+      (relative.size() >= 3 &&
+       !relative.compare(relative.size() - 3, 3, "/.."))) {
+    fprintf(stderr, "Cannot map %s into %s; exiting.", path.c_str(), dir);
+    exit(-3);
+  }
+  std::string output = std::string(dir) + '/' + relative;
+  size_t slash = output.rfind('/');
+  std::string parent = output.substr(0, slash);
+  if (parent != last_dir) {
+    for (size_t i = 1; i <= parent.size(); i++) {
+      if (i == parent.size() || parent[i] == '/') {
+        std::string prefix = parent.substr(0, i);
+        if (mkdir(prefix.c_str(), 0777) && errno != EEXIST) {
+          fprintf(stderr, "Cannot create %s; exiting.", prefix.c_str());
+          exit(-3);
+        }
+      }
+    }
+    last_dir = parent;
+  }
+  return output;
+}
+
+// Converts each of `paths` on its own into a file of the same relative path
+// under `dir` on `conversion.jobs` threads and reports the throughput in
+// files per second to stderr. Each worker resets one decoder and one
+// encoder per file instead of allocating new ones. With `use_ring`, each
+// worker reads and writes through an io_uring of its own if the kernel
+// allows, keeping reads of the next files and writes of the previous ones
+// in flight while it converts.
+void
+convert_batch(Conversion& conversion,
+              const std::vector<std::string>& paths,
+              const char* dir,
+              bool use_ring)
+{
+  const Encoding* input_encoding = conversion.decoder.encoding();
+  const Encoding* output_encoding = conversion.encoder.encoding();
+  bool use_utf16 = conversion.use_utf16;
+  size_t step = conversion.buffers.step();
+  unsigned jobs = std::max<unsigned>(
+    1, std::min<size_t>(conversion.jobs, std::max<size_t>(paths.size(), 1)));
+  WorkQueues queues(paths.size(), jobs);
+  std::vector<Stats> worker_stats(jobs);
+  std::atomic<uint64_t> total_bytes{ 0 };
+  auto start = std::chrono::steady_clock::now();
+
+  auto worker = [&](unsigned w) {
+    std::unique_ptr<Decoder> decoder = input_encoding->new_decoder();
+    std::unique_ptr<Encoder> encoder = output_encoding->new_encoder();
+    Buffers buffers(step, false);
+    buffers.fit(*decoder, *encoder, use_utf16);
+    if (conversion.stats) {
+      buffers.stats = &worker_stats[w];
+    }
+    std::unique_ptr<IoRing> ring = use_ring ? IoRing::create() : nullptr;
+    // Retargeted at each output file so that its regions are reused.
+    Output output;
+    output.use_ring(ring.get());
+    output.stats = buffers.stats;
+    std::string last_dir;
+    uint64_t bytes = 0;
+    // Starts converting a file whose input starts with `prefix`, of which
+    // `complete` says whether it is all of the input.
+    auto open_output = [&](const std::string& output_path,
+                           gsl::span<const uint8_t> prefix,
+                           bool complete) {
+      int fd = open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd == -1) {
+        fprintf(
+          stderr, "Cannot open %s for writing; exiting.", output_path.c_str());
+        exit(-3);
+      }
+      output.open(fd, true);
+      const Encoding* encoding = input_encoding;
+      if (conversion.detect) {
+        encoding = detect_encoding(
+          prefix.first(std::min<size_t>(prefix.size(), DETECTION_PREFIX_SIZE)),
+          complete && prefix.size() <= DETECTION_PREFIX_SIZE);
+      }
+      bool refit = (encoding != decoder->encoding());
+      encoding->new_decoder_into(*decoder);
+      output_encoding->new_encoder_into(*encoder);
+      if (refit) {
+        // The intermediate buffers depend on the input encoding.
+        buffers.fit(*decoder, *encoder, use_utf16);
+      } else {
+        buffers.transcoder->reset();
+      }
+    };
+    if (ring) {
+      // The output paths of the files being read ahead, in order.
+      std::deque<std::string> output_paths;
+      RingInput input(*ring,
+                      [&]() {
+                        size_t i;
+                        if (!queues.take(w, i)) {
+                          return -1;
+                        }
+                        output_paths.push_back(
+                          batch_output_path(dir, paths[i], last_dir));
+                        int fd = open(paths[i].c_str(), O_RDONLY);
+                        if (fd == -1) {
+                          fprintf(stderr,
+                                  "Cannot open %s for reading; exiting.",
+                                  paths[i].c_str());
+                          exit(-4);
+                        }
+                        return fd;
+                      },
+                      buffers.stats);
+      RingInput::Chunk chunk;
+      bool started = false;
+      while (input.next(chunk)) {
+        if (!started) {
+          open_output(output_paths.front(), chunk.data, chunk.file_end);
+          output_paths.pop_front();
+          started = true;
+        }
+        convert_in_steps(buffers, chunk.data, output, chunk.file_end);
+        bytes += chunk.data.size();
+        input.recycle(chunk);
+        if (chunk.file_end) {
+          output.close();
+          started = false;
+        }
+      }
+      total_bytes += bytes;
+      return;
+    }
+    std::vector<uint8_t> input;
+    size_t i;
+    while (queues.take(w, i)) {
+      const char* path = paths[i].c_str();
+      std::string output_path = batch_output_path(dir, paths[i], last_dir);
+      FILE* read = fopen(path, "rb");
+      if (!read) {
+        fprintf(stderr, "Cannot open %s for reading; exiting.", path);
+        exit(-4);
+      }
+      // The files are small, so read each one whole.
+      struct stat st;
+      if (!fstat(fileno(read), &st) && S_ISREG(st.st_mode) &&
+          input.size() <= static_cast<size_t>(st.st_size)) {
+        input.resize(static_cast<size_t>(st.st_size) + 1);
+      }
+      size_t length = 0;
+      for (;;) {
+        if (length == input.size()) {
+          input.resize(std::max<size_t>(2 * input.size(), 4096));
+        }
+        size_t n = timed_fread(
+          input.data() + length, input.size() - length, read, buffers.stats);
+        if (ferror(read)) {
+          fprintf(stderr, "Error reading input.");
+          exit(-5);
+        }
+        if (!n) {
+          break;
+        }
+        length += n;
+      }
+      fclose(read);
+
+      open_output(
+        output_path, gsl::span<const uint8_t>(input.data(), length), true);
+      convert_in_steps(buffers,
+                       gsl::span<const uint8_t>(input.data(), length),
+                       output,
+                       true);
+      output.close();
+      bytes += length;
+    }
+    total_bytes += bytes;
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned w = 0; w < jobs; w++) {
+    workers.emplace_back(worker, w);
+  }
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  if (conversion.stats) {
+    for (const Stats& stats : worker_stats) {
+      conversion.stats->merge(stats);
+    }
+  }
+  double seconds = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  fprintf(stderr,
+          "%zu files, %.1f MB in %.3f s: %.0f files/s, %.1f MB/s\n",
+          paths.size(),
+          total_bytes / 1e6,
+          seconds,
+          seconds > 0.0 ? paths.size() / seconds : 0.0,
+          seconds > 0.0 ? total_bytes / 1e6 / seconds : 0.0);
+}
+
+#define CHECK_SCRATCH_SIZE (64 * 1024)
+#define CHECK_LISTED_ERRORS 100
+
+// Validates input for --check by decoding it without replacement into a
+// scratch buffer that is thrown away. UTF-8 is skipped over with
+// `Encoding::utf8_valid_up_to()` instead, handing just the bytes where it
+// stops to the decoder one at a time to find out how long the malformed
+// sequence is.
+class Checker final
+{
+public:
+  Checker(uint64_t max_errors, Stats* stats)
+    : scratch_(CHECK_SCRATCH_SIZE)
+    , max_errors_(max_errors)
+    , stats_(stats)
+  {
+  }
+
+  // Starts checking an input in `encoding`, which a BOM at the start of the
+  // input overrides just like when converting.
+  void start(const Encoding* encoding)
+  {
+    encoding_ = encoding;
+    sniffing_ = true;
+    in_decoder_ = false;
+    offset_ = 0;
+    count_ = 0;
+    errors_.clear();
+  }
+
+  // Checks the next bytes of the input. Returns false once `max_errors`
+  // malformed sequences (unless 0) have been found, after which the rest of
+  // the input needn't be read.
+  bool check(gsl::span<const uint8_t> input, bool last)
+  {
+    if (sniffing_) {
+      sniffing_ = false;
+      auto bom = Encoding::for_bom(input);
+      if (bom) {
+        encoding_ = std::get<0>(*bom);
+        size_t length = std::get<1>(*bom);
+        input = input.subspan(length);
+        offset_ += length;
+      }
+      if (decoder_) {
+        encoding_->new_decoder_without_bom_handling_into(*decoder_);
+      } else {
+        decoder_ = encoding_->new_decoder_without_bom_handling();
+      }
+    }
+    size_t pos = 0;
+    bool more = encoding_ == UTF_8_ENCODING ? check_utf8(input, pos, last)
+                                            : decode(input, pos, last);
+    offset_ += input.size();
+    return more;
+  }
+
+  uint64_t count() const { return count_; }
+
+  // Appends the offsets of the first malformed sequences and a summary line
+  // for the input called `name` to `report`.
+  void print(std::string& report, const char* name) const
+  {
+    for (const auto& [offset, length] : errors_) {
+      report += name;
+      report += ':';
+      report += std::to_string(offset);
+      report += ": malformed sequence of length ";
+      report += std::to_string(length);
+      report += '\n';
+    }
+    report += name;
+    if (!count_) {
+      report += ": valid ";
+    } else {
+      report += max_errors_ && count_ >= max_errors_ ? ": at least " : ": ";
+      report += std::to_string(count_);
+      report += count_ == 1 ? " malformed sequence in " : " malformed "
+                                                           "sequences in ";
+    }
+    report += encoding_->name();
+    report += '\n';
+  }
+
+private:
+  bool check_utf8(gsl::span<const uint8_t> input, size_t& pos, bool last)
+  {
+    while (pos < input.size()) {
+      if (!in_decoder_) {
+        auto start = stats_start(stats_);
+        size_t valid = Encoding::utf8_valid_up_to(input.subspan(pos));
+        if (stats_) {
+          stats_->decode.record(start, valid, valid);
+        }
+        pos += valid;
+        in_decoder_ = pos < input.size();
+        continue;
+      }
+      auto start = stats_start(stats_);
+      auto [result, read, written] =
+        decoder_->decode_to_utf8_without_replacement(
+          input.subspan(pos, 1), scratch_, last && pos + 1 == input.size());
+      if (stats_) {
+        stats_->record_decode(
+          start, read, written, result, result != INPUT_EMPTY);
+      }
+      pos += read;
+      if (result == INPUT_EMPTY) {
+        // Back at a character boundary once a character is complete.
+        in_decoder_ = !written;
+        continue;
+      }
+      in_decoder_ = (result & 0xFF) != 0;
+      if (!report(pos, result)) {
+        return false;
+      }
+    }
+    if (last && in_decoder_) {
+      // The input ended in the middle of a sequence.
+      return decode(input, pos, true);
+    }
+    return true;
+  }
+
+  bool decode(gsl::span<const uint8_t> input, size_t& pos, bool last)
+  {
+    for (;;) {
+      auto start = stats_start(stats_);
+      auto [result, read, written] =
+        decoder_->decode_to_utf8_without_replacement(
+          input.subspan(pos), scratch_, last);
+      bool malformed = result != INPUT_EMPTY && result != OUTPUT_FULL;
+      if (stats_) {
+        stats_->record_decode(start, read, written, result, malformed);
+      }
+      pos += read;
+      if (result == INPUT_EMPTY) {
+        return true;
+      }
+      if (malformed && !report(pos, result)) {
+        return false;
+      }
+    }
+  }
+
+  // Records the malformed sequence that the decoder reported as `result`
+  // after reading up to `pos`.
+  bool report(size_t pos, uint32_t result)
+  {
+    uint32_t length = (result >> 8) & 0xFF;
+    uint32_t after = result & 0xFF;
+    if (errors_.size() < CHECK_LISTED_ERRORS) {
+      errors_.emplace_back(offset_ + pos - after - length, length);
+    }
+    count_++;
+    return !max_errors_ || count_ < max_errors_;
+  }
+
+  std::unique_ptr<Decoder> decoder_;
+  std::vector<uint8_t> scratch_;
+  const Encoding* encoding_ = nullptr;
+  // Whether the BOM at the start of the input is yet to be looked at.
+  bool sniffing_ = false;
+  // Whether the UTF-8 decoder is in the middle of a sequence.
+  bool in_decoder_ = false;
+  // Where in the input the bytes passed to `check()` start.
+  uint64_t offset_ = 0;
+  uint64_t count_ = 0;
+  uint64_t max_errors_;
+  std::vector<std::pair<uint64_t, uint32_t>> errors_;
+  Stats* stats_;
+};
+
+// Checks each of `paths`, or stdin starting with the already read
+// `stdin_prefix` if there are none, for malformed sequences on
+// `conversion.jobs` threads without converting anything. Regular files are
+// checked in place by mapping them into memory and the rest are read in
+// steps. A report per input is printed to stdout in the order of `paths`.
+// Returns whether all of the inputs are valid.
+bool
+check_inputs(Conversion& conversion,
+             const std::vector<std::string>& paths,
+             uint64_t max_errors,
+             gsl::span<const uint8_t> stdin_prefix)
+{
+  const Encoding* input_encoding = conversion.decoder.encoding();
+  size_t step = conversion.buffers.step();
+  bool from_stdin = paths.empty();
+  size_t count = from_stdin ? 1 : paths.size();
+  unsigned jobs =
+    std::max<unsigned>(1, std::min<size_t>(conversion.jobs, count));
+  WorkQueues queues(count, jobs);
+  std::vector<Stats> worker_stats(jobs);
+  // Each report is printed once the ones before it are.
+  std::mutex reports_mutex;
+  std::vector<std::optional<std::string>> reports(count);
+  size_t next_report = 0;
+  std::atomic<bool> all_valid{ true };
+
+  auto worker = [&](unsigned w) {
+    Stats* stats = conversion.stats ? &worker_stats[w] : nullptr;
+    Checker checker(max_errors, stats);
+    std::vector<uint8_t> buffer;
+    // Detection has already happened for stdin.
+    auto encoding_of = [&](gsl::span<const uint8_t> input, bool complete) {
+      if (!conversion.detect || from_stdin) {
+        return input_encoding;
+      }
+      return detect_encoding(
+        input.first(std::min<size_t>(input.size(), DETECTION_PREFIX_SIZE)),
+        complete && input.size() <= DETECTION_PREFIX_SIZE);
+    };
+    size_t i;
+    while (queues.take(w, i)) {
+      const char* name = from_stdin ? "-" : paths[i].c_str();
+      FILE* read = from_stdin ? stdin : fopen(name, "rb");
+      if (!read) {
+        fprintf(stderr, "Cannot open %s for reading; exiting.", name);
+        exit(-4);
+      }
+      bool mapped = false;
+      struct stat st;
+      if (!from_stdin && !fstat(fileno(read), &st) && S_ISREG(st.st_mode) &&
+          st.st_size == static_cast<off_t>(static_cast<size_t>(st.st_size))) {
+        size_t size = static_cast<size_t>(st.st_size);
+        void* map =
+          size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(read), 0)
+               : nullptr;
+        if (map != MAP_FAILED) {
+          if (map) {
+            madvise(map, size, MADV_SEQUENTIAL);
+          }
+          gsl::span<const uint8_t> input(static_cast<const uint8_t*>(map),
+                                         size);
+          checker.start(encoding_of(input, true));
+          checker.check(input, true);
+          if (map) {
+            munmap(map, size);
+          }
+          mapped = true;
+        }
+      }
+      if (!mapped) {
+        bool started = false;
+        bool more = true;
+        if (from_stdin && !stdin_prefix.empty()) {
+          checker.start(input_encoding);
+          started = true;
+          more = checker.check(stdin_prefix, false);
+        }
+        buffer.resize(step);
+        while (more) {
+          size_t n = timed_fread(buffer.data(), buffer.size(), read, stats);
+          if (ferror(read)) {
+            fprintf(stderr, "Error reading input.");
+            exit(-5);
+          }
+          gsl::span<const uint8_t> input(buffer.data(), n);
+          // fread() comes up short only at the end of the input.
+          bool last = n < buffer.size();
+          if (!started) {
+            checker.start(encoding_of(input, last));
+            started = true;
+          }
+          more = checker.check(input, last) && !last;
+        }
+      }
+      if (!from_stdin) {
+        fclose(read);
+      }
+      if (checker.count()) {
+        all_valid = false;
+      }
+      std::string report;
+      checker.print(report, name);
+      std::lock_guard<std::mutex> lock(reports_mutex);
+      reports[i] = std::move(report);
+      while (next_report < count && reports[next_report]) {
+        fputs(reports[next_report]->c_str(), stdout);
+        reports[next_report].reset();
+        next_report++;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned w = 0; w < jobs; w++) {
+    workers.emplace_back(worker, w);
+  }
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  if (conversion.stats) {
+    for (const Stats& stats : worker_stats) {
+      conversion.stats->merge(stats);
+    }
+  }
+  return all_valid;
+}
+
+#define SERVE_MAX_HEADER 256
+// Requests are held whole in memory, so cap them well below
+// MAX_BUFFER_SIZE.
+#define SERVE_MAX_REQUEST (16 * 1024 * 1024)
+#define SERVE_RECEIVE_SIZE (64 * 1024)
+#define SERVE_SEND_TIMEOUT 10
 
-void
-convert_via_utf8(Decoder& decoder,
-                 Encoder& encoder,
-                 FILE* read,
-                 FILE* write,
-                 bool last)
+// Request latencies in microseconds, counted in buckets of an eighth of a
+// power of two so that percentiles come out within 12.5% in constant
+// space. Safe to record into from several threads.
+class LatencyHistogram final
 {
-  std::array<uint8_t, INPUT_BUFFER_SIZE> input_buffer;
-  std::array<uint8_t, UTF8_INTERMEDIATE_BUFFER_SIZE> intermediate_buffer;
-  std::array<uint8_t, OUTPUT_BUFFER_SIZE> output_buffer;
+public:
+  void record(std::chrono::steady_clock::duration latency)
+  {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency)
+                .count();
+    buckets_[bucket(static_cast<uint64_t>(std::max<int64_t>(us, 0)))]
+      .fetch_add(1, std::memory_order_relaxed);
+  }
 
-  bool current_input_ended = false;
-  while (!current_input_ended) {
-    size_t decoder_input_end =
-      fread(input_buffer.data(), 1, input_buffer.size(), read);
-    if (ferror(read)) {
-      fprintf(stderr, "Error reading input.");
-      exit(-5);
+  void print(FILE* out) const
+  {
+    std::array<uint64_t, BUCKETS> counts;
+    uint64_t total = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      counts[i] = buckets_[i].load(std::memory_order_relaxed);
+      total += counts[i];
     }
-    current_input_ended = (decoder_input_end == 0);
-    bool input_ended = last && current_input_ended;
-    size_t decoder_input_start = 0;
-    for (;;) {
-      size_t decoder_read;
-      size_t decoder_written;
-      uint32_t decoder_result;
+    fprintf(out, "%" PRIu64 " requests", total);
+    if (!total) {
+      fprintf(out, "\n");
+      return;
+    }
+    const std::pair<const char*, double> percentiles[] = {
+      { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 },
+      { "p99.9", 0.999 }, { "max", 1.0 },
+    };
+    for (const auto& [name, fraction] : percentiles) {
+      uint64_t rank = std::max<uint64_t>(
+        1, static_cast<uint64_t>(ceil(fraction * total)));
+      uint64_t seen = 0;
+      size_t i = 0;
+      while ((seen += counts[i]) < rank) {
+        i++;
+      }
+      fprintf(out, ", %s %" PRIu64 " us", name, upper_bound(i));
+    }
+    fprintf(out, "\n");
+  }
+
+private:
+  static constexpr size_t BUCKETS = 62 * 8;
+
+  static size_t bucket(uint64_t us)
+  {
+    if (us < 8) {
+      return us;
+    }
+    size_t log = 63 - __builtin_clzll(us);
+    return (log - 2) * 8 + ((us >> (log - 3)) & 7);
+  }
 
-      std::tie(decoder_result, decoder_read, decoder_written, std::ignore) =
-        decoder.decode_to_utf8(
-          gsl::span<const uint8_t>(input_buffer)
-            .subspan(decoder_input_start,
-                     decoder_input_end - decoder_input_start),
-          intermediate_buffer,
-          input_ended);
-      decoder_input_start += decoder_read;
+  static uint64_t upper_bound(size_t bucket)
+  {
+    if (bucket < 8) {
+      return bucket;
+    }
+    size_t log = bucket / 8 + 2;
+    return ((9 + bucket % 8) << (log - 3)) - 1;
+  }
 
-      bool last_output = (input_ended && (decoder_result == INPUT_EMPTY));
+  std::array<std::atomic<uint64_t>, BUCKETS> buckets_{};
+};
 
-      // Regardless of whether the intermediate buffer got full
-      // or the input buffer was exhausted, let's process what's
-      // in the intermediate buffer.
+// A client connection. With EPOLLONESHOT, whichever worker gets its event
+// owns it until re-arming it.
+struct ServerConnection
+{
+  int fd;
+  // Received bytes not yet answered.
+  std::vector<uint8_t> input;
+  // When the connection became readable, which is when a request that
+  // completes with the bytes read then is taken to start.
+  std::chrono::steady_clock::time_point ready;
+};
 
-      if (encoder.encoding() == UTF_8_ENCODING) {
-        // If the target is UTF-8, optimize out the encoder.
-        size_t file_written =
-          fwrite(intermediate_buffer.data(), 1, decoder_written, write);
-        if (file_written != decoder_written) {
-          fprintf(stderr, "Error writing output.");
-          exit(-7);
+// Listens on the Unix domain socket at `path` and converts requests on
+// `conversion.jobs` worker threads until SIGINT or SIGTERM, printing the
+// latency percentiles to stderr then and on SIGUSR1.
+//
+// A request is a "FROM TO LENGTH\n" line, with FROM possibly auto, and
+// LENGTH bytes, at most SERVE_MAX_REQUEST, to convert. It is answered
+// with "OK LENGTH\n" and the converted bytes or with "ERR MESSAGE\n". A
+// connection can carry any number of requests, which are answered in order.
+//
+// An epoll loop on the main thread accepts connections and queues the ones
+// that become readable. The workers receive without blocking until a
+// request is complete, convert it with a decoder and an encoder from their
+// thread's `CoderPool` and send the answer.
+void
+serve(Conversion& conversion, const char* path)
+{
+  bool use_utf16 = conversion.use_utf16;
+  size_t step = conversion.buffers.step();
+  unsigned jobs = std::max<unsigned>(1, conversion.jobs);
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s is too long for a socket path; exiting.", path);
+    exit(-3);
+  }
+  strcpy(address.sun_path, path);
+  struct stat st;
+  if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+    // Left behind by an earlier run.
+    unlink(path);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1 ||
+      bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) ||
+      listen(listener, SOMAXCONN)) {
+    fprintf(stderr, "Cannot listen on %s; exiting.", path);
+    exit(-3);
+  }
+
+  // Blocked before the workers start so that they inherit the mask and the
+  // signals arrive only through the signalfd.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (signal_fd == -1 || epoll_fd == -1) {
+    fprintf(stderr, "Cannot set up the event loop; exiting.");
+    exit(-3);
+  }
+  epoll_event event{};
+  event.events = EPOLLIN;
+  event.data.ptr = nullptr;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+  event.data.ptr = &signal_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+
+  LatencyHistogram latencies;
+  std::mutex queue_mutex;
+  std::condition_variable queue_ready;
+  std::deque<ServerConnection*> queue;
+  // All open connections, including idle ones that only epoll knows about,
+  // so that the ones still open at shutdown can be closed.
+  std::unordered_set<ServerConnection*> connections;
+  bool stopping = false;
+  // Held in reserve for accepting and closing a connection when out of
+  // descriptors. Otherwise, the connection would stay in the backlog and
+  // the level-triggered listener would wake the loop again at once.
+  int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  auto rearm = [&](ServerConnection* connection) {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = connection;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+  };
+
+  auto worker = [&]() {
+    Buffers buffers(step, false);
+    Output body;
+    // Answers to the requests received so far, sent together: a socket
+    // charges each send against its buffer far beyond the bytes sent, so
+    // answering a pipeline of small requests one send at a time could fill
+    // the buffer while the client is still writing.
+    Output response;
+    size_t answered_since_send = 0;
+    std::vector<uint8_t> received(SERVE_RECEIVE_SIZE);
+    auto respond = [&](const std::string& text) {
+      response.write(gsl::span<const uint8_t>(
+        reinterpret_cast<const uint8_t*>(text.data()), text.size()));
+    };
+    // Answers the request at the start of `connection->input` if it is
+    // complete. Returns false if the connection should be closed.
+    auto answer = [&](ServerConnection* connection, bool& answered) {
+      std::vector<uint8_t>& input = connection->input;
+      answered = false;
+      auto newline = std::find(
+        input.begin(),
+        input.begin() + std::min<size_t>(input.size(), SERVE_MAX_HEADER),
+        '\n');
+      if (newline == input.end()) {
+        return true;
+      }
+      size_t header_length = newline - input.begin() + 1;
+      std::string header(input.begin(), newline);
+      char from_label[64];
+      char to_label[64];
+      unsigned long long length;
+      char rest;
+      if (newline - input.begin() == SERVE_MAX_HEADER ||
+          sscanf(header.c_str(),
+                 "%63s %63s %llu %c",
+                 from_label,
+                 to_label,
+                 &length,
+                 &rest) != 3) {
+        respond("ERR bad request\n");
+        return false;
+      }
+      if (length > SERVE_MAX_REQUEST) {
+        respond("ERR request too long\n");
+        return false;
+      }
+      // The input grows as the bytes arrive rather than up front to the
+      // length that the client claims.
+      if (input.size() - header_length < length) {
+        return true;
+      }
+      answered = true;
+      gsl::span<const uint8_t> request(input.data() + header_length,
+                                       static_cast<size_t>(length));
+      const Encoding* from =
+        !strcmp(from_label, "auto")
+          ? detect_encoding(request.first(std::min<size_t>(
+                              request.size(), DETECTION_PREFIX_SIZE)),
+                            request.size() <= DETECTION_PREFIX_SIZE)
+          : Encoding::for_label(
+              gsl::cstring_span<>(from_label, strlen(from_label)));
+      const Encoding* to =
+        Encoding::for_label(gsl::cstring_span<>(to_label, strlen(to_label)));
+      if (!from || !to) {
+        respond(std::string("ERR unknown encoding ") +
+                (from ? to_label : from_label) + '\n');
+      } else {
+        PooledDecoder decoder = from->pooled_decoder();
+        PooledEncoder encoder = to->pooled_encoder();
+        buffers.fit(*decoder, *encoder, use_utf16);
+        convert_in_steps(buffers, request, body, true);
+        respond("OK " + std::to_string(body.pending()) + '\n');
+        response.take(body);
+      }
+      answered_since_send++;
+      input.erase(input.begin(), input.begin() + header_length + length);
+      return true;
+    };
+    // Sends the answers so far. The requests they answer count as having
+    // started when the connection became readable or, if this worker already
+    // sent answers since, at the last send.
+    auto send_response = [&](ServerConnection* connection) {
+      bool sent = response.send(connection->fd);
+      auto now = std::chrono::steady_clock::now();
+      for (; answered_since_send; answered_since_send--) {
+        latencies.record(now - connection->ready);
+      }
+      connection->ready = now;
+      return sent;
+    };
+
+    for (;;) {
+      ServerConnection* connection;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_ready.wait(lock, [&] { return stopping || !queue.empty(); });
+        if (stopping) {
+          return;
+        }
+        connection = queue.front();
+        queue.pop_front();
+      }
+      bool open = true;
+      for (;;) {
+        bool answered;
+        do {
+          open = answer(connection, answered);
+          // Bounds the memory held for a client that pipelines a lot.
+          bool send_now = !open || !answered ||
+                          response.pending() >= OUTPUT_FLUSH_SIZE;
+          if (send_now && response.pending() && !send_response(connection)) {
+            open = false;
+          }
+        } while (open && answered);
+        if (!open) {
+          break;
         }
+        ssize_t n = recv(connection->fd,
+                         received.data(),
+                         received.size(),
+                         MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        }
+        if (n <= 0) {
+          open = false;
+          break;
+        }
+        connection->input.insert(
+          connection->input.end(), received.begin(), received.begin() + n);
+      }
+      if (open) {
+        rearm(connection);
       } else {
-        size_t encoder_input_start = 0;
+        {
+          std::lock_guard<std::mutex> lock(queue_mutex);
+          connections.erase(connection);
+        }
+        // Closing removes the descriptor from the epoll set.
+        close(connection->fd);
+        delete connection;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned w = 0; w < jobs; w++) {
+    workers.emplace_back(worker);
+  }
+
+  std::array<epoll_event, 64> events;
+  bool running = true;
+  while (running) {
+    int count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count < 0) {
+      fprintf(stderr, "Error waiting for events; exiting.");
+      exit(-3);
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+      void* ptr = events[i].data.ptr;
+      if (!ptr) {
         for (;;) {
-          size_t encoder_read;
-          size_t encoder_written;
-          uint32_t encoder_result;
-
-          std::tie(encoder_result, encoder_read, encoder_written, std::ignore) =
-            encoder.encode_from_utf8(
-              std::string_view(
-                reinterpret_cast<char*>(intermediate_buffer.data()),
-                intermediate_buffer.size())
-                .substr(encoder_input_start,
-                        decoder_written - encoder_input_start),
-              output_buffer,
-              last_output);
-          encoder_input_start += encoder_read;
-          size_t file_written =
-            fwrite(output_buffer.data(), 1, encoder_written, write);
-          if (file_written != encoder_written) {
-            fprintf(stderr, "Error writing output.");
-            exit(-6);
+          int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+          if (fd == -1 && (errno == EMFILE || errno == ENFILE) &&
+              spare_fd != -1) {
+            // Sheds the connection, which the client sees as closed.
+            close(spare_fd);
+            fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd != -1) {
+              close(fd);
+            }
+            spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+              break;
+            }
+            continue;
           }
-          if (encoder_result == INPUT_EMPTY) {
+          if (fd == -1) {
+            // EAGAIN once the backlog is empty; otherwise, e.g.
+            // ECONNABORTED, the connection waits for the next round.
             break;
           }
+          // Sends block, up to a point, so that a worker can finish an
+          // answer to a client that reads slowly.
+          timeval timeout = { SERVE_SEND_TIMEOUT, 0 };
+          setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+          ServerConnection* connection = new ServerConnection{ fd, {}, now };
+          {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            connections.insert(connection);
+          }
+          epoll_event event{};
+          event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+          event.data.ptr = connection;
+          epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
         }
-      }
-
-      // Now let's see if we should read again or process the
-      // rest of the current input buffer.
-      if (decoder_result == INPUT_EMPTY) {
-        break;
+      } else if (ptr == &signal_fd) {
+        signalfd_siginfo info;
+        if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+          continue;
+        }
+        latencies.print(stderr);
+        if (info.ssi_signo != SIGUSR1) {
+          running = false;
+        }
+      } else {
+        ServerConnection* connection = static_cast<ServerConnection*>(ptr);
+        connection->ready = now;
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.push_back(connection);
+        queue_ready.notify_one();
       }
     }
   }
+
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  queue_ready.notify_all();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  // Those still queued or idle.
+  for (ServerConnection* connection : connections) {
+    close(connection->fd);
+    delete connection;
+  }
+  if (spare_fd != -1) {
+    close(spare_fd);
+  }
+  close(listener);
+  unlink(path);
 }
 
-void
-convert_via_utf16(Decoder& decoder,
-                  Encoder& encoder,
-                  FILE* read,
-                  FILE* write,
-                  bool last)
+#define RECORD_BATCH_SIZE (256 * 1024)
+#define RECORD_STEP_SIZE (4 * 1024)
+#define RECORD_DECODERS 8
+
+// How --records splits the input into records and records into fields.
+enum class RecordFormat
 {
-  std::array<uint8_t, INPUT_BUFFER_SIZE> input_buffer;
-  std::array<char16_t, UTF16_INTERMEDIATE_BUFFER_SIZE> intermediate_buffer;
-  std::array<uint8_t, OUTPUT_BUFFER_SIZE> output_buffer;
+  Csv,
+  Tsv,
+  Nul,
+};
 
-  bool current_input_ended = false;
-  while (!current_input_ended) {
-    size_t decoder_input_end =
-      fread(input_buffer.data(), 1, input_buffer.size(), read);
-    if (ferror(read)) {
-      fprintf(stderr, "Error reading input.");
-      exit(-5);
+// The decoders of one --records worker, one for each of the encodings it
+// saw last, each with buffers fitted to it and the worker's encoder. A
+// record costs a reset of its encoding's decoder with new_decoder_into()
+// instead of an allocation, and the transcoder keeps its byte table while
+// a feed alternates between a few encodings.
+class RecordDecoders final
+{
+public:
+  struct Entry
+  {
+    Entry()
+      : encoding(nullptr)
+      , buffers(RECORD_STEP_SIZE, false)
+    {
     }
-    current_input_ended = (decoder_input_end == 0);
-    bool input_ended = last && current_input_ended;
-    size_t decoder_input_start = 0;
-    for (;;) {
-      size_t decoder_read;
-      size_t decoder_written;
-      uint32_t decoder_result;
 
-      std::tie(decoder_result, decoder_read, decoder_written, std::ignore) =
-        decoder.decode_to_utf16(
-          gsl::span<const uint8_t>(input_buffer)
-            .subspan(decoder_input_start,
-                     decoder_input_end - decoder_input_start),
-          intermediate_buffer,
-          input_ended);
-      decoder_input_start += decoder_read;
+    const Encoding* encoding;
+    std::unique_ptr<Decoder> decoder;
+    Buffers buffers;
+  };
 
-      bool last_output = (input_ended && (decoder_result == INPUT_EMPTY));
+  RecordDecoders(Encoder& encoder, bool use_utf16, Stats* stats)
+    : encoder_(encoder)
+    , use_utf16_(use_utf16)
+    , stats_(stats)
+  {
+  }
 
-      // Regardless of whether the intermediate buffer got full
-      // or the input buffer was exhausted, let's process what's
-      // in the intermediate buffer.
+  // Returns the entry for `encoding` with its decoder reset. The encoder
+  // must have been reset already. Reuses the decoder that was used least
+  // recently if there are RECORD_DECODERS already.
+  Entry& get(const Encoding* encoding)
+  {
+    auto it = std::find_if(
+      entries_.begin(), entries_.end(), [&](const std::unique_ptr<Entry>& e) {
+        return e->encoding == encoding;
+      });
+    if (it != entries_.end()) {
+      std::rotate(entries_.begin(), it, it + 1);
+      encoding->new_decoder_into(*entries_.front()->decoder);
+    } else if (entries_.size() == RECORD_DECODERS) {
+      std::rotate(entries_.begin(), entries_.end() - 1, entries_.end());
+      Entry& entry = *entries_.front();
+      entry.encoding = encoding;
+      encoding->new_decoder_into(*entry.decoder);
+      entry.buffers.fit(*entry.decoder, encoder_, use_utf16_);
+    } else {
+      auto entry = std::make_unique<Entry>();
+      entry->encoding = encoding;
+      entry->decoder = encoding->new_decoder();
+      entry->buffers.fit(*entry->decoder, encoder_, use_utf16_);
+      entry->buffers.stats = stats_;
+      entries_.insert(entries_.begin(), std::move(entry));
+    }
+    entries_.front()->buffers.transcoder->reset();
+    return *entries_.front();
+  }
 
-      size_t encoder_input_start = 0;
-      for (;;) {
-        size_t encoder_read;
-        size_t encoder_written;
-        uint32_t encoder_result;
+private:
+  Encoder& encoder_;
+  bool use_utf16_;
+  Stats* stats_;
+  // Most recently used first.
+  std::vector<std::unique_ptr<Entry>> entries_;
+};
 
-        std::tie(encoder_result, encoder_read, encoder_written, std::ignore) =
-          encoder.encode_from_utf16(
-            std::u16string_view(intermediate_buffer.data(),
-                                intermediate_buffer.size())
-              .substr(encoder_input_start,
-                      decoder_written - encoder_input_start),
-            output_buffer,
-            last_output);
-        encoder_input_start += encoder_read;
-        size_t file_written =
-          fwrite(output_buffer.data(), 1, encoder_written, write);
-        if (file_written != encoder_written) {
-          fprintf(stderr, "Error writing output.");
-          exit(-6);
+// Returns field `field` (counting from 1) of `record` without the quotes
+// around it, or an empty span if the record has fewer fields.
+gsl::span<const uint8_t>
+record_field(gsl::span<const uint8_t> record, RecordFormat format, size_t field)
+{
+  uint8_t separator = format == RecordFormat::Csv ? ',' : '\t';
+  size_t start = 0;
+  bool quoted = false;
+  for (size_t i = 0; i <= record.size(); i++) {
+    if (i < record.size() && format == RecordFormat::Csv && record[i] == '"') {
+      quoted = !quoted;
+    } else if (i == record.size() || (record[i] == separator && !quoted)) {
+      if (!--field) {
+        gsl::span<const uint8_t> value = record.subspan(start, i - start);
+        if (!value.empty() && value[value.size() - 1] == '\r') {
+          value = value.first(value.size() - 1);
         }
-        if (encoder_result == INPUT_EMPTY) {
-          break;
+        if (value.size() >= 2 && value[0] == '"' &&
+            value[value.size() - 1] == '"') {
+          value = value.subspan(1, value.size() - 2);
+        }
+        return value;
+      }
+      start = i + 1;
+    }
+  }
+  return gsl::span<const uint8_t>();
+}
+
+// Converts records of `format` from the files at `paths` (stdin if there are
+// none), taken as one stream, each from its own encoding: the one named by
+// field `charset_field` of the record (counting from 1; 0 for none) or by
+// the corresponding line of `charsets`, if given. Records without a known
+// label are converted from the input encoding or, with -f auto, from what
+// their content looks like. The delimiter after each record is copied.
+//
+// The calling thread splits the input into batches of whole records, which
+// `conversion.jobs` workers convert into memory, each with its own
+// `RecordDecoders`, and writes the batches out in input order. A CSV
+// delimiter or separator in double quotes doesn't count, which is safe to
+// find bytewise in the encodings that CSV files are in practice: no
+// ASCII-compatible encoding uses those bytes inside a multi-byte sequence.
+void
+convert_records(Conversion& conversion,
+                RecordFormat format,
+                size_t charset_field,
+                FILE* charsets,
+                std::vector<const char*> paths,
+                Output& output)
+{
+  uint8_t delimiter = format == RecordFormat::Nul ? '\0' : '\n';
+  const Encoding* input_encoding = conversion.decoder.encoding();
+  const Encoding* output_encoding = conversion.encoder.encoding();
+
+  struct Batch
+  {
+    std::vector<uint8_t> input;
+    // Where each record ends, after its delimiter if it has one.
+    std::vector<size_t> ends;
+    // From `charsets`; null for the records it has no known label for.
+    std::vector<const Encoding*> encodings;
+    // Whether the last record is the end of the input without a delimiter.
+    bool unterminated = false;
+    Output output;
+    bool done = false;
+  };
+  // The batches being converted or waiting to be written, in input order.
+  // The front one is batch number `first`.
+  std::deque<std::unique_ptr<Batch>> batches;
+  size_t first = 0;
+  size_t next = 0;
+  bool input_ended = false;
+  size_t window = 2 * conversion.jobs;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<size_t> unlabeled(0);
+
+  bool use_utf16 = conversion.use_utf16;
+  bool detect = conversion.detect;
+  std::vector<Stats> worker_stats(conversion.jobs);
+  auto worker = [&](unsigned w) {
+    std::unique_ptr<Encoder> encoder = output_encoding->new_encoder();
+    RecordDecoders decoders(
+      *encoder, use_utf16, conversion.stats ? &worker_stats[w] : nullptr);
+    for (;;) {
+      Batch* batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock,
+                [&]() { return input_ended || next < first + batches.size(); });
+        if (next == first + batches.size()) {
+          return;
+        }
+        batch = batches[next++ - first].get();
+      }
+      size_t start = 0;
+      for (size_t r = 0; r < batch->ends.size(); r++) {
+        gsl::span<const uint8_t> record(&batch->input[start],
+                                        batch->ends[r] - start);
+        start = batch->ends[r];
+        bool terminated = !batch->unterminated || r + 1 < batch->ends.size();
+        if (terminated) {
+          record = record.first(record.size() - 1);
+        }
+        const Encoding* encoding =
+          batch->encodings.empty() ? nullptr : batch->encodings[r];
+        if (!encoding && charset_field) {
+          gsl::span<const uint8_t> label =
+            record_field(record, format, charset_field);
+          encoding = Encoding::for_label(gsl::cstring_span<>(
+            reinterpret_cast<const char*>(label.data()), label.size()));
+        }
+        if (!encoding) {
+          unlabeled++;
+          encoding = detect ? detect_encoding(record, true) : input_encoding;
+        }
+        output_encoding->new_encoder_into(*encoder);
+        RecordDecoders::Entry& entry = decoders.get(encoding);
+        convert_in_steps(entry.buffers, record, batch->output, true);
+        if (terminated) {
+          // Every encoder's output is ASCII-compatible at the end of the
+          // stream.
+          batch->output.write(gsl::span<const uint8_t>(&delimiter, 1));
         }
       }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch->done = true;
+      }
+      cv.notify_all();
+    }
+  };
 
-      // Now let's see if we should read again or process the
-      // rest of the current input buffer.
-      if (decoder_result == INPUT_EMPTY) {
-        break;
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < conversion.jobs; i++) {
+    workers.emplace_back(worker, i);
+  }
+
+  // Writes the batches at the front that are done. With `wait`, waits for
+  // all batches to be done, and otherwise until there is room in the window
+  // for another batch.
+  auto write_done = [&](bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      while (!batches.empty() && batches.front()->done) {
+        std::unique_ptr<Batch> batch = std::move(batches.front());
+        batches.pop_front();
+        first++;
+        lock.unlock();
+        // Hands the batch's regions to the output without copying them.
+        output.take(batch->output);
+        lock.lock();
+      }
+      if (wait ? batches.empty() : batches.size() < window) {
+        return;
+      }
+      cv.wait(lock);
+    }
+  };
+  auto submit = [&](std::unique_ptr<Batch> batch) {
+    if (charsets) {
+      char* line = nullptr;
+      size_t capacity = 0;
+      for (size_t r = 0; r < batch->ends.size(); r++) {
+        ssize_t length = getline(&line, &capacity, charsets);
+        batch->encodings.push_back(
+          length > 0 ? Encoding::for_label(gsl::cstring_span<>(
+                         line, static_cast<size_t>(length)))
+                     : nullptr);
+      }
+      free(line);
+    }
+    write_done(false);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      batches.push_back(std::move(batch));
+    }
+    cv.notify_all();
+  };
+
+  auto batch = std::make_unique<Batch>();
+  // How much of the current batch has been searched for delimiters, and
+  // whether that part ends inside double quotes.
+  size_t scanned = 0;
+  bool quoted = false;
+  auto read_records = [&](FILE* read) {
+    for (;;) {
+      std::vector<uint8_t>& input = batch->input;
+      size_t have = input.size();
+      input.resize(have + conversion.buffers.step());
+      size_t n = timed_fread(
+        input.data() + have, input.size() - have, read, conversion.stats);
+      if (ferror(read)) {
+        fprintf(stderr, "Error reading input.");
+        exit(-5);
+      }
+      input.resize(have + n);
+      if (!n) {
+        return;
+      }
+      if (format != RecordFormat::Csv) {
+        for (const uint8_t* found;
+             (found = static_cast<const uint8_t*>(memchr(
+                input.data() + scanned, delimiter, input.size() - scanned)));) {
+          scanned = found - input.data() + 1;
+          batch->ends.push_back(scanned);
+        }
+      } else {
+        for (; scanned < input.size(); scanned++) {
+          if (input[scanned] == '"') {
+            quoted = !quoted;
+          } else if (input[scanned] == delimiter && !quoted) {
+            batch->ends.push_back(scanned + 1);
+          }
+        }
+      }
+      scanned = input.size();
+      if (batch->ends.empty() || batch->ends.back() < RECORD_BATCH_SIZE) {
+        continue;
       }
+      // Carries the incomplete record at the end over to the next batch.
+      auto rest = std::make_unique<Batch>();
+      rest->input.assign(input.begin() + batch->ends.back(), input.end());
+      input.resize(batch->ends.back());
+      scanned = rest->input.size();
+      submit(std::move(batch));
+      batch = std::move(rest);
+    }
+  };
+  if (paths.empty()) {
+    read_records(stdin);
+  }
+  for (const char* path : paths) {
+    FILE* read = fopen(path, "rb");
+    if (!read) {
+      fprintf(stderr, "Cannot open %s for reading; exiting.", path);
+      exit(-4);
+    }
+    read_records(read);
+    fclose(read);
+  }
+  if (batch->ends.empty() || batch->ends.back() < batch->input.size()) {
+    batch->ends.push_back(batch->input.size());
+    batch->unterminated = true;
+  }
+  if (!batch->input.empty()) {
+    submit(std::move(batch));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    input_ended = true;
+  }
+  cv.notify_all();
+  write_done(true);
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  if (conversion.stats) {
+    for (Stats& stats : worker_stats) {
+      conversion.stats->merge(stats);
     }
   }
+  if (unlabeled && (charset_field || charsets)) {
+    fprintf(stderr,
+            "%zu records had no known charset label and were converted "
+            "from %s.\n",
+            unlabeled.load(),
+            detect ? "the detected encoding" : input_encoding->name().c_str());
+  }
 }
 
-void
-convert(Decoder& decoder,
-        Encoder& encoder,
-        FILE* read,
-        FILE* write,
-        bool last,
-        bool use_utf16)
-{
-  if (use_utf16) {
-    convert_via_utf16(decoder, encoder, read, write, last);
-  } else {
-    convert_via_utf8(decoder, encoder, read, write, last);
+// Returns how long the conversion of the files at `paths` can get unless
+// the input contains unmappable characters, or 0 if that isn't known up
+// front because some of them aren't regular files.
+size_t
+max_output_length(const Conversion& conversion, char** begin, char** end)
+{
+  size_t total = 0;
+  for (char** path = begin; path != end; path++) {
+    struct stat st;
+    if (stat(*path, &st) || !S_ISREG(st.st_mode)) {
+      return 0;
+    }
+    total += static_cast<size_t>(st.st_size);
+  }
+  const Decoder& decoder = conversion.decoder;
+  const Encoder& encoder = conversion.encoder;
+  if (conversion.use_utf16) {
+    auto utf16 = decoder.max_utf16_buffer_length(total);
+    if (!utf16) {
+      return 0;
+    }
+    return encoder.max_buffer_length_from_utf16_if_no_unmappables(*utf16)
+      .value_or(0);
+  }
+  auto utf8 = decoder.max_utf8_buffer_length(total);
+  if (!utf8 || encoder.encoding() == UTF_8_ENCODING) {
+    return utf8.value_or(0);
+  }
+  return encoder.max_buffer_length_from_utf8_if_no_unmappables(*utf8).value_or(
+    0);
+}
+
+// Returns the first DETECTION_PREFIX_SIZE bytes of the concatenation of the
+// files at `begin` to `end`, or reads them from stdin if there are none.
+// Sets `complete` if the prefix is all of the input. Exits if a file that
+// isn't a regular file comes before the prefix is full, since reading it
+// here would consume what the conversion needs and detecting without it
+// would guess from too little.
+//
+// Only the reads from stdin count as reads in `stats`: the conversion
+// reads the files again from the start.
+//
+// With `eager`, takes what the first read from stdin returns instead of
+// waiting for a full prefix, so that --line-buffered output from a stream
+// that trickles in doesn't wait for 64 KB first.
+std::vector<uint8_t>
+detection_prefix(char** begin,
+                 char** end,
+                 bool& complete,
+                 bool eager,
+                 Stats* stats)
+{
+  std::vector<uint8_t> prefix(DETECTION_PREFIX_SIZE);
+  size_t length = 0;
+  complete = true;
+  if (begin == end) {
+    // Bypasses stdio so that nothing beyond the prefix is buffered.
+    while (length < prefix.size()) {
+      auto start = stats_start(stats);
+      ssize_t n = read(STDIN_FILENO, &prefix[length], prefix.size() - length);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        fprintf(stderr, "Error reading input.");
+        exit(-5);
+      }
+      if (stats) {
+        stats->read.record(start, n, n);
+      }
+      if (!n) {
+        break;
+      }
+      length += static_cast<size_t>(n);
+      if (eager) {
+        complete = false;
+        prefix.resize(length);
+        return prefix;
+      }
+    }
+    complete = length < prefix.size();
+  }
+  for (char** path = begin; path != end && length < prefix.size(); path++) {
+    struct stat st;
+    if (!stat(*path, &st) && !S_ISREG(st.st_mode)) {
+      fprintf(stderr,
+              "Cannot detect the encoding of %s, which isn't a regular file; "
+              "give its encoding with -f or pipe it to stdin; exiting.",
+              *path);
+      exit(-4);
+    }
+    FILE* read = fopen(*path, "rb");
+    if (!read) {
+      fprintf(stderr, "Cannot open %s for reading; exiting.", *path);
+      exit(-4);
+    }
+    length += fread(&prefix[length], 1, prefix.size() - length, read);
+    if (ferror(read)) {
+      fprintf(stderr, "Error reading input.");
+      exit(-5);
+    }
+    complete = complete && (fgetc(read) == EOF);
+    fclose(read);
   }
+  if (length == prefix.size() && begin != end) {
+    complete = false;
+  }
+  prefix.resize(length);
+  return prefix;
 }
 
 int
@@ -243,18 +5023,55 @@ main(int argc, char** argv)
     { "from-code", required_argument, NULL, 'f' },
     { "to-code", required_argument, NULL, 't' },
     { "utf16-intermediate", no_argument, NULL, 'u' },
+    { "no-mmap", no_argument, NULL, 'N' },
+    { "io", required_argument, NULL, 'I' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "pipeline", no_argument, NULL, 'p' },
+    { "line-buffered", optional_argument, NULL, 'l' },
+    { "records", required_argument, NULL, 'R' },
+    { "charset-field", required_argument, NULL, 'F' },
+    { "charsets", required_argument, NULL, 'C' },
+    { "buffer-size", required_argument, NULL, 'b' },
+    { "stats", optional_argument, NULL, 's' },
+    { "batch", required_argument, NULL, 'B' },
+    { "preallocate", no_argument, NULL, 'P' },
+    { "check", no_argument, NULL, 'c' },
+    { "max-errors", required_argument, NULL, 'e' },
+    { "serve", required_argument, NULL, 'S' },
+    { "version", no_argument, NULL, 'V' },
     { "help", no_argument, NULL, 'h' },
     { 0, 0, 0, 0 }
   };
 
   bool use_utf16 = false;
+  bool use_mmap = true;
+  bool use_ring = false;
+  unsigned jobs = 1;
+  bool use_pipeline = false;
+  std::optional<std::chrono::milliseconds> line_deadline;
+  std::optional<RecordFormat> record_format;
+  size_t charset_field = 0;
+  FILE* charsets = nullptr;
+  size_t buffer_size = DEFAULT_BUFFER_SIZE;
+  std::optional<Stats> stats;
+  bool stats_json = false;
+  const char* batch_dir = nullptr;
+  bool preallocate = false;
+  bool detect = false;
+  bool check = false;
+  uint64_t max_errors = 0;
+  const char* serve_path = nullptr;
   const Encoding* input_encoding = UTF_8_ENCODING;
   const Encoding* output_encoding = UTF_8_ENCODING;
-  FILE* output = stdout;
+  const char* output_path = nullptr;
 
   for (;;) {
     int option_index = 0;
-    int c = getopt_long(argc, argv, "o:f:t:uh", long_options, &option_index);
+    int c = getopt_long(argc,
+                        argv,
+                        "o:f:t:uNI:j:pl::R:F:C:b:s::B:Pce:S:Vh",
+                        long_options,
+                        &option_index);
     if (c == -1) {
       break;
     }
@@ -264,14 +5081,13 @@ main(int argc, char** argv)
     }
     switch (c) {
       case 'o':
-        output = fopen(optarg, "wb");
-        if (!output) {
-          fprintf(stderr, "Cannot open %s for writing; exiting.", optarg);
-          exit(-3);
-        }
+        output_path = strcmp(optarg, "-") ? optarg : nullptr;
         break;
       case 'f':
-        input_encoding = get_encoding(optarg);
+        detect = !strcmp(optarg, "auto");
+        if (!detect) {
+          input_encoding = get_encoding(optarg);
+        }
         break;
       case 't':
         output_encoding = get_encoding(optarg);
@@ -279,6 +5095,84 @@ main(int argc, char** argv)
       case 'u':
         use_utf16 = true;
         break;
+      case 'N':
+        use_mmap = false;
+        use_ring = false;
+        break;
+      case 'I':
+        use_mmap = !strcmp(optarg, "mmap");
+        use_ring = !strcmp(optarg, "uring");
+        if (!use_mmap && !use_ring && strcmp(optarg, "stdio")) {
+          fprintf(stderr, "%s is not a known I/O backend; exiting.", optarg);
+          exit(-2);
+        }
+        break;
+      case 'j':
+        jobs = get_count(optarg);
+        break;
+      case 'p':
+        use_pipeline = true;
+        break;
+      case 'l':
+        line_deadline = optarg ? get_deadline(optarg)
+                               : std::chrono::milliseconds(10);
+        break;
+      case 'R':
+        if (!strcmp(optarg, "csv")) {
+          record_format = RecordFormat::Csv;
+        } else if (!strcmp(optarg, "tsv")) {
+          record_format = RecordFormat::Tsv;
+        } else if (!strcmp(optarg, "nul")) {
+          record_format = RecordFormat::Nul;
+        } else {
+          fprintf(stderr, "%s is not a known record format; exiting.", optarg);
+          exit(-2);
+        }
+        break;
+      case 'F':
+        charset_field = get_count(optarg);
+        break;
+      case 'C':
+        charsets = fopen(optarg, "rb");
+        if (!charsets) {
+          fprintf(stderr, "Cannot open %s for reading; exiting.", optarg);
+          exit(-4);
+        }
+        break;
+      case 'b':
+        buffer_size = get_size(optarg);
+        break;
+      case 's':
+        stats.emplace();
+        if (optarg && !strcmp(optarg, "json")) {
+          stats_json = true;
+        } else if (optarg && strcmp(optarg, "text")) {
+          fprintf(stderr, "%s is not a known stats format; exiting.", optarg);
+          exit(-2);
+        }
+        break;
+      case 'B':
+        batch_dir = optarg;
+        break;
+      case 'P':
+        preallocate = true;
+        break;
+      case 'c':
+        check = true;
+        break;
+      case 'e':
+        max_errors = get_limit(optarg);
+        break;
+      case 'S':
+        serve_path = optarg;
+        break;
+      case 'V':
+        printf("recode_cpp\n"
+               "single-byte kernel: %s\n"
+               "Rust target features: %s\n",
+               simd_name(simd_level()),
+               rustglue_target_features());
+        exit(0);
       case 'h':
         print_usage(argv[0]);
         exit(0);
@@ -290,11 +5184,136 @@ main(int argc, char** argv)
     }
   }
 
+  if ((charset_field || charsets) && !record_format) {
+    fprintf(stderr, "--charset-field and --charsets need --records; exiting.");
+    exit(-2);
+  }
+  if (charset_field && record_format == RecordFormat::Nul) {
+    fprintf(stderr, "NUL-terminated records have no fields; exiting.");
+    exit(-2);
+  }
+  if (output_path && batch_dir) {
+    fprintf(stderr, "--output and --batch don't go together; exiting.");
+    exit(-2);
+  }
+  // Opened only now so that a rejected command line leaves no file behind.
+  int output_fd = STDOUT_FILENO;
+  if (output_path) {
+    output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (output_fd == -1) {
+      fprintf(stderr, "Cannot open %s for writing; exiting.", output_path);
+      exit(-3);
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  Stats* stats_ptr = stats ? &*stats : nullptr;
+  // What detection consumed from stdin, which is converted first.
+  std::vector<uint8_t> stdin_prefix;
+  // Batch and check modes detect each file on its own, the server each
+  // request and record mode each record without a label.
+  bool detect_each =
+    batch_dir || serve_path || record_format || (check && optind < argc);
+  if (detect && !detect_each) {
+    bool complete;
+    std::vector<uint8_t> prefix =
+      detection_prefix(argv + optind,
+                       argv + argc,
+                       complete,
+                       line_deadline.has_value(),
+                       stats_ptr);
+    input_encoding = detect_encoding(prefix, complete);
+    if (optind == argc) {
+      stdin_prefix = std::move(prefix);
+    }
+  }
   std::unique_ptr<Decoder> decoder = input_encoding->new_decoder();
   std::unique_ptr<Encoder> encoder = output_encoding->new_encoder();
+  Conversion conversion{ *decoder,
+                         *encoder,
+                         use_utf16,
+                         jobs,
+                         Buffers(buffer_size ? buffer_size
+                                             : ADAPTIVE_MIN_BUFFER_SIZE,
+                                 !buffer_size),
+                         std::nullopt,
+                         std::nullopt,
+                         stats_ptr,
+                         detect };
+  conversion.buffers.fit(*decoder, *encoder, use_utf16);
+  conversion.buffers.stats = stats_ptr;
+  if (!use_utf16 && input_encoding == output_encoding &&
+      PassThrough::supports(input_encoding)) {
+    conversion.pass_through.emplace(input_encoding, stats_ptr);
+  } else if (SingleByteConverter::supports(input_encoding, output_encoding)) {
+    conversion.single_byte.emplace(input_encoding, output_encoding, stats_ptr);
+  }
+  // Batch mode sets up a ring per worker and check and serve modes don't
+  // write to the output.
+  bool ring_output = use_ring && !batch_dir && !use_pipeline &&
+                     !line_deadline && !check && !serve_path;
+  std::unique_ptr<IoRing> ring = ring_output ? IoRing::create() : nullptr;
+  // Positional writes only make sense for a file opened here.
+  Output output(output_fd, output_fd != STDOUT_FILENO, ring.get());
+  output.stats = stats_ptr;
+  if (line_deadline) {
+    output.avoid_splice();
+  }
+  if (preallocate && !batch_dir && !check && !serve_path && optind < argc) {
+    output.preallocate(
+      max_output_length(conversion, argv + optind, argv + argc));
+  }
+  if (!stdin_prefix.empty() && !check) {
+    convert_buffer(conversion, stdin_prefix, -1, 0, output, false);
+    if (line_deadline) {
+      output.flush();
+    }
+  }
 
-  if (optind == argc) {
-    convert(*decoder, *encoder, stdin, output, true, use_utf16);
+  bool valid = true;
+  if (serve_path) {
+    serve(conversion, serve_path);
+  } else if (check) {
+    valid = check_inputs(conversion,
+                         std::vector<std::string>(argv + optind, argv + argc),
+                         max_errors,
+                         stdin_prefix);
+  } else if (batch_dir) {
+    convert_batch(conversion,
+                  batch_paths(argv + optind, argv + argc),
+                  batch_dir,
+                  use_ring);
+  } else if (record_format) {
+    convert_records(conversion,
+                    *record_format,
+                    charset_field,
+                    charsets,
+                    std::vector<const char*>(argv + optind, argv + argc),
+                    output);
+  } else if (line_deadline) {
+    if (optind == argc) {
+      convert_lines(conversion, STDIN_FILENO, output, true, *line_deadline);
+    }
+    while (optind < argc) {
+      const char* path = argv[optind++];
+      int fd = open(path, O_RDONLY);
+      if (fd == -1) {
+        fprintf(stderr, "Cannot open %s for reading; exiting.", path);
+        exit(-4);
+      }
+      convert_lines(conversion, fd, output, optind == argc, *line_deadline);
+      close(fd);
+    }
+  } else if (use_pipeline) {
+    convert_pipelined(
+      conversion, std::vector<const char*>(argv + optind, argv + argc), output);
+  } else if (ring) {
+    convert_ring(conversion,
+                 *ring,
+                 std::vector<const char*>(argv + optind, argv + argc),
+                 output);
+  } else if (optind == argc) {
+    convert(conversion, stdin, output, true);
   } else {
     while (optind < argc) {
       const char* path = argv[optind++];
@@ -303,9 +5322,22 @@ main(int argc, char** argv)
         fprintf(stderr, "Cannot open %s for reading; exiting.", path);
         exit(-4);
       }
-      convert(*decoder, *encoder, read, output, (optind == argc), use_utf16);
+      bool last = (optind == argc);
+      if (!use_mmap ||
+          !convert_mapped(conversion, fileno(read), output, last)) {
+        convert(conversion, read, output, last);
+      }
+      fclose(read);
     }
   }
 
-  exit(0);
+  output.finish();
+  if (stats) {
+    if (detect && !detect_each) {
+      stats->detected = input_encoding;
+    }
+    stats->print(
+      stderr, stats_json, std::chrono::steady_clock::now() - start);
+  }
+  exit(valid ? 0 : 1);
 }
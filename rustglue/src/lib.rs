@@ -8,3 +8,25 @@
 // except according to those terms.
 
 extern crate encoding_c;
+
+use std::os::raw::c_char;
+
+/// Returns the highest x86 SIMD target feature that this crate, including
+/// encoding_rs, was compiled with as a NUL-terminated string. Unlike the
+/// C++ kernels, the Rust code selects its vector code at compile time,
+/// e.g. with `RUSTFLAGS="-C target-cpu=x86-64-v3"`.
+#[no_mangle]
+pub extern "C" fn rustglue_target_features() -> *const c_char {
+    let name: &'static [u8] = if cfg!(target_feature = "avx512bw") {
+        b"avx512bw\0"
+    } else if cfg!(target_feature = "avx2") {
+        b"avx2\0"
+    } else if cfg!(target_feature = "sse4.2") {
+        b"sse4.2\0"
+    } else if cfg!(target_feature = "sse2") {
+        b"sse2\0"
+    } else {
+        b"none\0"
+    };
+    name.as_ptr() as *const c_char
+}